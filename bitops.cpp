@@ -0,0 +1,195 @@
+//
+// Bit operation kernels for bitmap values, with AVX2 and SSE versions
+// picked at runtime and a portable scalar fallback
+//
+#include <cstring> // For memcpy
+
+#include "bitops.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // For SSE and AVX2 intrinsics
+#define FII_DB_X86 1
+#endif
+
+// Counts the set bits of [p, p + n), eight bytes at a time
+static uint64_t count_scalar(const uint8_t *p, size_t n)
+{
+    uint64_t cnt = 0;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        uint64_t w = 0;
+        memcpy(&w, p + i, 8); // Unaligned load
+        cnt += (uint64_t)__builtin_popcountll(w);
+    }
+    for (; i < n; ++i)
+    {
+        cnt += (uint64_t)__builtin_popcount(p[i]);
+    }
+    return cnt;
+}
+
+// Applies dst op= src, eight bytes at a time
+static void op_scalar(uint32_t op, uint8_t *dst, const uint8_t *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        uint64_t a = 0, b = 0;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a = (op == BITOP_AND) ? (a & b) : (op == BITOP_OR) ? (a | b) : (a ^ b);
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < n; ++i)
+    {
+        dst[i] = (op == BITOP_AND) ? (dst[i] & src[i]) : (op == BITOP_OR) ? (dst[i] | src[i]) : (dst[i] ^ src[i]);
+    }
+}
+
+// Returns the index of the first byte that is not 'skip', or n
+static size_t skip_scalar(const uint8_t *p, size_t n, uint8_t skip)
+{
+    uint64_t pattern = 0x0101010101010101ULL * skip;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        uint64_t w = 0;
+        memcpy(&w, p + i, 8);
+        if (w != pattern)
+            break; // The byte is in this word
+    }
+    for (; i < n; ++i)
+    {
+        if (p[i] != skip)
+            return i;
+    }
+    return n;
+}
+
+#ifdef FII_DB_X86
+
+// Same as count_scalar, compiled with the POPCNT instruction
+__attribute__((target("popcnt"))) static uint64_t count_popcnt(const uint8_t *p, size_t n)
+{
+    return count_scalar(p, n);
+}
+
+// Counts set bits 32 bytes at a time: each nibble is looked up in a table of
+// bit counts with vpshufb, and the byte counts are summed with vpsadbw
+__attribute__((target("avx2"))) static uint64_t count_avx2(const uint8_t *p, size_t n)
+{
+    const __m256i lut = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    while (i + 32 <= n)
+    {
+        // Byte counts are at most 8 per step, so 31 steps can't overflow a byte
+        __m256i local = _mm256_setzero_si256();
+        size_t end = (n - i) / 32 > 31 ? i + 31 * 32 : i + (n - i) / 32 * 32;
+        for (; i < end; i += 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+            __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, low));
+            __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+            local = _mm256_add_epi8(local, _mm256_add_epi8(lo, hi));
+        }
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(local, _mm256_setzero_si256()));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + count_popcnt(p + i, n - i);
+}
+
+// Applies dst op= src 16 bytes at a time (SSE2)
+__attribute__((target("sse2"))) static void op_sse2(uint32_t op, uint8_t *dst, const uint8_t *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+        a = (op == BITOP_AND) ? _mm_and_si128(a, b) : (op == BITOP_OR) ? _mm_or_si128(a, b) : _mm_xor_si128(a, b);
+        _mm_storeu_si128((__m128i *)(dst + i), a);
+    }
+    op_scalar(op, dst + i, src + i, n - i);
+}
+
+// Applies dst op= src 32 bytes at a time (AVX2)
+__attribute__((target("avx2"))) static void op_avx2(uint32_t op, uint8_t *dst, const uint8_t *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+        a = (op == BITOP_AND) ? _mm256_and_si256(a, b) : (op == BITOP_OR) ? _mm256_or_si256(a, b) : _mm256_xor_si256(a, b);
+        _mm256_storeu_si256((__m256i *)(dst + i), a);
+    }
+    op_scalar(op, dst + i, src + i, n - i);
+}
+
+// Finds the first byte that is not 'skip', comparing 32 bytes at a time
+__attribute__((target("avx2"))) static size_t skip_avx2(const uint8_t *p, size_t n, uint8_t skip)
+{
+    const __m256i pattern = _mm256_set1_epi8((char)skip);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        uint32_t eq = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pattern));
+        if (eq != 0xffffffffu)
+            return i + (size_t)__builtin_ctz(~eq); // First byte that differs
+    }
+    return i + skip_scalar(p + i, n - i, skip);
+}
+
+#endif // FII_DB_X86
+
+// Kernels picked for this CPU on first use
+static struct BitKernels
+{
+    uint64_t (*count)(const uint8_t *, size_t) = count_scalar;
+    void (*op)(uint32_t, uint8_t *, const uint8_t *, size_t) = op_scalar;
+    size_t (*skip)(const uint8_t *, size_t, uint8_t) = skip_scalar;
+
+    BitKernels()
+    {
+#ifdef FII_DB_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+        {
+            count = count_avx2;
+            op = op_avx2;
+            skip = skip_avx2;
+        }
+        else if (__builtin_cpu_supports("sse2"))
+        {
+            if (__builtin_cpu_supports("popcnt"))
+                count = count_popcnt;
+            op = op_sse2;
+        }
+#endif
+    }
+} g_bits;
+
+// Counts the set bits of [p, p + n)
+uint64_t bits_count(const uint8_t *p, size_t n)
+{
+    return g_bits.count(p, n);
+}
+
+// Applies dst op= src over n bytes
+void bits_op(uint32_t op, uint8_t *dst, const uint8_t *src, size_t n)
+{
+    g_bits.op(op, dst, src, n);
+}
+
+// Returns the index of the first byte of [p, p + n) that is not 'skip', or n
+size_t bits_skip_bytes(const uint8_t *p, size_t n, uint8_t skip)
+{
+    return g_bits.skip(p, n, skip);
+}
@@ -0,0 +1,25 @@
+//
+// Bit operation kernels for bitmap values, with AVX2 and SSE versions
+// picked at runtime and a portable scalar fallback
+//
+#include <cstddef> // For size_t
+#include <cstdint> // For fixed-width integer types
+
+#ifndef FII_DB_BITOPS_H
+#define FII_DB_BITOPS_H
+
+// Enumeration for the operations of 'bitop'
+enum BITOP_OPS
+{
+    BITOP_AND = 0, // dst &= src
+    BITOP_OR = 1,  // dst |= src
+    BITOP_XOR = 2, // dst ^= src
+};
+
+uint64_t bits_count(const uint8_t *p, size_t n);
+
+void bits_op(uint32_t op, uint8_t *dst, const uint8_t *src, size_t n);
+
+size_t bits_skip_bytes(const uint8_t *p, size_t n, uint8_t skip);
+
+#endif // FII_DB_BITOPS_H
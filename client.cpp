@@ -121,24 +121,24 @@
 
 int main(int argc, char **argv)
 {
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0)
+    // an optional leading "--connect ADDR" picks the server, e.g.
+    // "127.0.0.1:1234" or "unix:/tmp/simple_db.sock"
+    const char *addr = "127.0.0.1:1234";
+    int first = 1;
+    if (argc > 2 && 0 == strcmp(argv[1], "--connect"))
     {
-        die("socket()");
+        addr = argv[2];
+        first = 3;
     }
 
-    struct sockaddr_in addr = {};
-    addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(1234);
-    addr.sin_addr.s_addr = ntohl(INADDR_LOOPBACK); // 127.0.0.1
-    int rv = connect(fd, (const struct sockaddr *)&addr, sizeof(addr));
-    if (rv)
+    int fd = connect_to(addr);
+    if (fd < 0)
     {
         die("connect");
     }
 
     std::vector<std::string> cmd;
-    for (int i = 1; i < argc; ++i)
+    for (int i = first; i < argc; ++i)
     {
         cmd.push_back(argv[i]);
     }
@@ -147,11 +147,15 @@ int main(int argc, char **argv)
     {
         goto L_DONE;
     }
-    err = read_res(fd);
+    err = read_res(fd, !cmd.empty() && cmd_is(cmd[0], "hgetall")); // Its reply is a list of strings
     if (err)
     {
         goto L_DONE;
     }
+    if (!cmd.empty() && (cmd_is(cmd[0], "subscribe") || cmd_is(cmd[0], "psubscribe")))
+    {
+        (void)read_res(fd, false); // Print published messages until the server goes away
+    }
 
 L_DONE:
     close(fd);
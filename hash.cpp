@@ -0,0 +1,131 @@
+//
+// Hash value type: a flat listpack while small, a hash table once it grows
+//
+#include "hash.h"
+
+// Returns the offset of the entry holding 'field' in a listpack, or npos.
+// Entries are scanned linearly, which beats hashing for a few short fields
+// that all sit in one or two cache lines
+static size_t lp_find(const std::string &lp, const std::string &field)
+{
+    size_t pos = 0;
+    while (pos < lp.size())
+    {
+        size_t flen = (uint8_t)lp[pos];                             // Length of the field
+        size_t vlen = (uint8_t)lp[pos + 1 + flen];                  // Length of the value
+        if (flen == field.size() && 0 == lp.compare(pos + 1, flen, field))
+            return pos;                                             // Found the field
+        pos += 2 + flen + vlen;                                     // Move to the next entry
+    }
+    return std::string::npos; // Field not present
+}
+
+// Moves every listpack entry into the hash table encoding
+static void lp_convert(HashObj *h)
+{
+    hash_foreach(h, [h](std::string_view f, std::string_view v) {
+        h->table.emplace(std::string(f), std::string(v));
+    });
+    h->is_table = true;
+    h->lp.clear();
+    h->lp.shrink_to_fit(); // Release the listpack memory
+    h->lp_count = 0;
+}
+
+// Looks up a field, storing its value in 'out'. Returns false if not found
+bool hash_get(const HashObj *h, const std::string &field, std::string *out)
+{
+    if (h->is_table)
+    {
+        auto it = h->table.find(field);
+        if (it == h->table.end())
+            return false;
+        *out = it->second;
+        return true;
+    }
+    size_t pos = lp_find(h->lp, field);
+    if (pos == std::string::npos)
+        return false;
+    size_t vpos = pos + 1 + field.size();                 // Position of the value length
+    out->assign(h->lp, vpos + 1, (uint8_t)h->lp[vpos]);   // Copy the value out
+    return true;
+}
+
+// Sets a field, converting to a hash table past the size thresholds.
+// Returns true if the field is new
+bool hash_set(HashObj *h, const std::string &field, const std::string &val)
+{
+    if (!h->is_table)
+    {
+        size_t pos = lp_find(h->lp, field);
+        bool fits = field.size() <= k_hash_lp_max_len && val.size() <= k_hash_lp_max_len;
+        bool grows = pos == std::string::npos;
+        if (!fits || (grows && h->lp_count >= k_hash_lp_max_entries))
+        {
+            lp_convert(h); // Too big for the listpack, fall through to the table
+        }
+        else if (!grows)
+        {
+            size_t vpos = pos + 1 + field.size();   // Position of the value length
+            size_t vlen = (uint8_t)h->lp[vpos];     // Length of the old value
+            h->lp[vpos] = (char)val.size();
+            h->lp.replace(vpos + 1, vlen, val);     // Overwrite the value in place
+            return false;
+        }
+        else
+        {
+            h->lp.push_back((char)field.size()); // Append a new entry at the end
+            h->lp.append(field);
+            h->lp.push_back((char)val.size());
+            h->lp.append(val);
+            h->lp_count++;
+            return true;
+        }
+    }
+    auto res = h->table.insert_or_assign(field, val);
+    return res.second;
+}
+
+// Removes a field. Returns true if it existed
+bool hash_del(HashObj *h, const std::string &field)
+{
+    if (h->is_table)
+        return h->table.erase(field) > 0;
+    size_t pos = lp_find(h->lp, field);
+    if (pos == std::string::npos)
+        return false;
+    size_t vlen = (uint8_t)h->lp[pos + 1 + field.size()]; // Length of the value
+    h->lp.erase(pos, 2 + field.size() + vlen);           // Drop the whole entry
+    h->lp_count--;
+    return true;
+}
+
+// Returns the number of fields in a hash
+size_t hash_len(const HashObj *h)
+{
+    return h->is_table ? h->table.size() : h->lp_count;
+}
+
+// Calls 'fn' for every field and value in a hash
+void hash_foreach(
+    const HashObj *h,
+    const std::function<void(std::string_view field, std::string_view val)> &fn)
+{
+    if (h->is_table)
+    {
+        for (const auto &kv : h->table)
+        {
+            fn(kv.first, kv.second);
+        }
+        return;
+    }
+    const std::string &lp = h->lp;
+    size_t pos = 0;
+    while (pos < lp.size())
+    {
+        size_t flen = (uint8_t)lp[pos];            // Length of the field
+        size_t vlen = (uint8_t)lp[pos + 1 + flen]; // Length of the value
+        fn(std::string_view(&lp[pos + 1], flen), std::string_view(&lp[pos + 2 + flen], vlen));
+        pos += 2 + flen + vlen; // Move to the next entry
+    }
+}
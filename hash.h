@@ -0,0 +1,40 @@
+//
+// Hash value type: a flat listpack while small, a hash table once it grows
+//
+#include <cstdint>       // For fixed-width integer types
+#include <string>        // For std::string class
+#include <string_view>   // For std::string_view
+#include <functional>    // For std::function
+#include <unordered_map> // For std::unordered_map container
+
+#ifndef FII_DB_HASH_H
+#define FII_DB_HASH_H
+
+// A hash stays in the listpack encoding while it has at most this many fields...
+const size_t k_hash_lp_max_entries = 128;
+
+// ...and every field and value is at most this many bytes long
+const size_t k_hash_lp_max_len = 64;
+
+// Structure representing a hash value
+struct HashObj
+{
+    bool is_table = false;                               // False while using the listpack encoding
+    std::string lp;                                      // Listpack: repeated [u8 flen][field][u8 vlen][value]
+    size_t lp_count = 0;                                 // Number of fields in the listpack
+    std::unordered_map<std::string, std::string> table;  // Hash table encoding, used once the hash grows
+};
+
+bool hash_get(const HashObj *h, const std::string &field, std::string *out);
+
+bool hash_set(HashObj *h, const std::string &field, const std::string &val);
+
+bool hash_del(HashObj *h, const std::string &field);
+
+size_t hash_len(const HashObj *h);
+
+void hash_foreach(
+    const HashObj *h,
+    const std::function<void(std::string_view field, std::string_view val)> &fn);
+
+#endif // FII_DB_HASH_H
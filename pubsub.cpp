@@ -0,0 +1,111 @@
+//
+// Publish/subscribe: delivers messages published on a channel to the
+// connections subscribed to it, or to a pattern matching it
+//
+#include <fnmatch.h>     // For fnmatch, matching channels against glob patterns
+#include <memory>        // For std::shared_ptr
+#include <unordered_map> // For std::unordered_map container
+#include <unordered_set> // For std::unordered_set container
+#include <utility>       // For std::pair
+#include <vector>        // For std::vector container
+
+#include "pubsub.h"
+#include "utility.h"
+
+// Global pub/sub state
+static struct
+{
+    std::unordered_map<std::string, std::unordered_set<Conn *>> channels; // Channel -> subscribers
+    std::unordered_map<std::string, std::unordered_set<Conn *>> patterns; // Pattern -> subscribers
+} g_pubsub;
+
+// Subscribes a connection to a channel, or to every channel matching a pattern
+void pubsub_subscribe(Conn *conn, const std::string &name, bool pattern)
+{
+    std::unordered_set<std::string> &mine = pattern ? conn->patterns : conn->channels;
+    if (mine.insert(name).second)
+    {
+        (pattern ? g_pubsub.patterns : g_pubsub.channels)[name].insert(conn);
+    }
+}
+
+// Removes a connection from the subscribers of one channel or pattern
+static void drop(
+    std::unordered_map<std::string, std::unordered_set<Conn *>> &all,
+    const std::string &name, Conn *conn)
+{
+    auto it = all.find(name);
+    it->second.erase(conn);
+    if (it->second.empty())
+    {
+        all.erase(it); // Drop the channel along with its last subscriber
+    }
+}
+
+// Unsubscribes a connection from a channel or pattern
+void pubsub_unsubscribe(Conn *conn, const std::string &name, bool pattern)
+{
+    std::unordered_set<std::string> &mine = pattern ? conn->patterns : conn->channels;
+    if (mine.erase(name))
+    {
+        drop(pattern ? g_pubsub.patterns : g_pubsub.channels, name, conn);
+    }
+}
+
+// Unsubscribes a connection from all its channels, or all its patterns
+void pubsub_unsubscribe_all(Conn *conn, bool pattern)
+{
+    std::unordered_set<std::string> &mine = pattern ? conn->patterns : conn->channels;
+    for (const std::string &name : mine)
+    {
+        drop(pattern ? g_pubsub.patterns : g_pubsub.channels, name, conn);
+    }
+    mine.clear();
+}
+
+// Publishes a message and sets *n to the number of deliveries. Subscribers
+// get a push frame ["message", channel, message], or ["pmessage", pattern,
+// channel, message] for a pattern subscription. Each frame is built once
+// and shared by the output queues of its subscribers, so a large fan-out
+// costs no copies. Returns false, delivering nothing, if a frame would be
+// larger than clients accept
+bool pubsub_publish(const std::string &channel, const std::string &message, size_t *n)
+{
+    std::vector<std::pair<const std::unordered_set<Conn *> *, std::shared_ptr<const std::string>>> outs;
+    auto it = g_pubsub.channels.find(channel);
+    if (it != g_pubsub.channels.end())
+    {
+        outs.emplace_back(&it->second, std::make_shared<const std::string>(
+                                           make_push_frame({"message", channel, message})));
+    }
+    for (auto &kv : g_pubsub.patterns)
+    {
+        if (0 == fnmatch(kv.first.c_str(), channel.c_str(), 0))
+        {
+            outs.emplace_back(&kv.second, std::make_shared<const std::string>(
+                                              make_push_frame({"pmessage", kv.first, channel, message})));
+        }
+    }
+    for (auto &out : outs)
+    {
+        if (out.second->size() > 8 + k_max_msg)
+            return false; // Length and code headers plus a body of at most k_max_msg
+    }
+    *n = 0;
+    for (auto &out : outs)
+    {
+        for (Conn *conn : *out.first)
+        {
+            conn_queue_shared(conn, out.second);
+        }
+        *n += out.first->size();
+    }
+    return true;
+}
+
+// Called when a connection is closed
+void pubsub_forget(Conn *conn)
+{
+    pubsub_unsubscribe_all(conn, false);
+    pubsub_unsubscribe_all(conn, true);
+}
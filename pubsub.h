@@ -0,0 +1,23 @@
+//
+// Publish/subscribe: delivers messages published on a channel to the
+// connections subscribed to it, or to a pattern matching it
+//
+#include <cstddef> // For size_t
+#include <string>  // For std::string class
+
+#include "types.h"
+
+#ifndef FII_DB_PUBSUB_H
+#define FII_DB_PUBSUB_H
+
+void pubsub_subscribe(Conn *conn, const std::string &name, bool pattern);
+
+void pubsub_unsubscribe(Conn *conn, const std::string &name, bool pattern);
+
+void pubsub_unsubscribe_all(Conn *conn, bool pattern);
+
+bool pubsub_publish(const std::string &channel, const std::string &message, size_t *n);
+
+void pubsub_forget(Conn *conn);
+
+#endif // FII_DB_PUBSUB_H
@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
@@ -15,51 +16,176 @@
 #include <map>
 
 #include "utility.h"
+#include "vlog.h"
+#include "slowlog.h"
 
-int main()
+// Exits with an error about an option value
+static void bad_opt(const char *name, const char *val)
 {
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0)
+    fprintf(stderr, "bad value for %s: %s\n", name, val);
+    exit(1);
+}
+
+// Parses a numeric option value, exiting on malformed input
+static uint64_t parse_num_opt(const char *name, const char *val)
+{
+    char *end = NULL;
+    errno = 0;
+    unsigned long long n = strtoull(val, &end, 10);
+    if (errno || end == val || *end != '\0')
     {
-        die("socket()");
+        bad_opt(name, val);
     }
+    return (uint64_t)n;
+}
 
-    int val = 1;
-    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+// Fills g_opts from the command line
+static void parse_args(int argc, char **argv)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *name = argv[i];
+        if (i + 1 >= argc)
+        {
+            fprintf(stderr, "missing value for %s\n", name);
+            exit(1);
+        }
+        const char *arg = argv[++i];
+        if (0 == strcmp(name, "--listen"))
+        {
+            g_opts.listen.push_back(arg); // May be given several times
+            continue;
+        }
+        if (0 == strcmp(name, "--vlog-dir"))
+        {
+            g_opts.vlog_dir = arg;
+            continue;
+        }
+        if (0 == strcmp(name, "--trace-file"))
+        {
+            g_opts.trace_file = arg;
+            continue;
+        }
+        uint64_t val = parse_num_opt(name, arg);
+        if (0 == strcmp(name, "--max-reqs-per-io"))
+        {
+            if (val == 0 || val > UINT32_MAX)
+                bad_opt(name, arg); // A budget of 0 would never serve anything
+            g_opts.max_reqs_per_io = (uint32_t)val;
+        }
+        else if (0 == strcmp(name, "--max-bytes-per-io"))
+        {
+            if (val == 0)
+                bad_opt(name, arg);
+            g_opts.max_bytes_per_io = (size_t)val;
+        }
+        else if (0 == strcmp(name, "--obuf-pause"))
+        {
+            g_opts.obuf_pause = (size_t)val;
+        }
+        else if (0 == strcmp(name, "--obuf-soft-limit"))
+        {
+            g_opts.obuf_soft_limit = (size_t)val;
+        }
+        else if (0 == strcmp(name, "--obuf-soft-seconds"))
+        {
+            g_opts.obuf_soft_secs = val;
+        }
+        else if (0 == strcmp(name, "--obuf-hard-limit"))
+        {
+            g_opts.obuf_hard_limit = (size_t)val;
+        }
+        else if (0 == strcmp(name, "--vlog-max-memory"))
+        {
+            g_opts.vlog_max_mem = (size_t)val;
+        }
+        else if (0 == strcmp(name, "--tracking-max-keys"))
+        {
+            g_opts.tracking_max_keys = (size_t)val;
+        }
+        else if (0 == strcmp(name, "--slowlog-slower-than"))
+        {
+            g_opts.slowlog_slower_than = val;
+        }
+        else if (0 == strcmp(name, "--slowlog-max-len"))
+        {
+            g_opts.slowlog_max_len = (size_t)val;
+        }
+        else if (0 == strcmp(name, "--sndbuf"))
+        {
+            if (val > INT_MAX)
+                bad_opt(name, arg); // setsockopt() takes an int
+            g_opts.sndbuf = (int)val;
+        }
+        else if (0 == strcmp(name, "--rcvbuf"))
+        {
+            if (val > INT_MAX)
+                bad_opt(name, arg); // setsockopt() takes an int
+            g_opts.rcvbuf = (int)val;
+        }
+        else
+        {
+            fprintf(stderr, "unknown option: %s\n", name);
+            exit(1);
+        }
+    }
+}
 
-    // bind
-    struct sockaddr_in addr = {};
-    addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(1234);
-    addr.sin_addr.s_addr = ntohl(0); // wildcard address 0.0.0.0
-    int rv = bind(fd, (const sockaddr *)&addr, sizeof(addr));
-    if (rv)
+int main(int argc, char **argv)
+{
+    parse_args(argc, argv);
+
+    if (g_opts.listen.empty())
     {
-        die("bind()");
+        g_opts.listen.push_back(k_default_addr);
     }
 
-    // listen
-    rv = listen(fd, SOMAXCONN);
-    if (rv)
+    // bind and listen on every configured address
+    std::vector<int> listen_fds;
+    for (const std::string &spec : g_opts.listen)
     {
-        die("listen()");
+        listen_fds.push_back(listen_on(spec.c_str()));
+    }
+
+    // tiered storage, if a value log directory was given
+    if (!g_opts.vlog_dir.empty())
+    {
+        vlog_init(g_opts.vlog_dir);
+    }
+
+    // trace events, if a trace file was given
+    if (!g_opts.trace_file.empty())
+    {
+        trace_open(g_opts.trace_file.c_str());
     }
 
     // a map of all client connections, keyed by fd
     std::vector<Conn *> fd2conn;
 
-    // set the listen fd to nonblocking mode
-    fd_set_nb(fd);
-
     // the event loop
     std::vector<struct pollfd> poll_args;
+    size_t rr_start = 0;      // rotates which connection is served first
+    bool vlog_busy = false;   // the value log has eviction work left
     while (true)
     {
         // prepare the arguments of the poll()
         poll_args.clear();
-        // for convenience, the listening fd is put in the first position
-        struct pollfd pfd = {fd, POLLIN, 0};
-        poll_args.push_back(pfd);
+        // for convenience, the listening fds are put in the first positions
+        for (int fd : listen_fds)
+        {
+            struct pollfd pfd = {fd, POLLIN, 0};
+            poll_args.push_back(pfd);
+        }
+        size_t nlisten = listen_fds.size();
+        // then the value log's completion fd, if any
+        if (vlog_event_fd() >= 0)
+        {
+            struct pollfd pfd = {vlog_event_fd(), POLLIN, 0};
+            poll_args.push_back(pfd);
+        }
+        size_t nfixed = poll_args.size();
+        // connections that still hold unserved requests from the last round
+        bool has_pending = false;
         // connection fds
         for (Conn *conn : fd2conn)
         {
@@ -69,41 +195,70 @@ int main()
             }
             struct pollfd pfd = {};
             pfd.fd = conn->fd;
-            pfd.events = (conn->state == STATE_REQ) ? POLLIN : POLLOUT;
+            pfd.events = (conn->state == STATE_REQ) ? POLLIN : 0;
+            if (conn_pending_out(conn))
+            {
+                pfd.events = pfd.events | POLLOUT;
+            }
             pfd.events = pfd.events | POLLERR;
             poll_args.push_back(pfd);
+            has_pending = has_pending || conn_has_pending_req(conn);
         }
 
         // poll for active fds
-        // the timeout argument doesn't matter here
-        int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), 1000);
+        // don't wait if some connection was cut short by its budget
+        int timeout = (has_pending || vlog_busy) ? 0 : 1000;
+        int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), timeout);
         if (rv < 0)
         {
             die("poll");
         }
 
-        // process active connections
-        for (size_t i = 1; i < poll_args.size(); ++i)
+        // deliver finished value log reads, then evict and compact
+        vlog_busy = vlog_cron(fd2conn);
+
+        // process active connections, round-robin so that the same
+        // connection doesn't always get served first
+        uint64_t now_ms = get_monotonic_msec();
+        uint64_t now_ns = trace_enabled() ? get_monotonic_nsec() : 0;
+        trace_cron(now_ms);
+        size_t nconns = poll_args.size() - nfixed;
+        for (size_t k = 0; k < nconns; ++k)
         {
-            if (poll_args[i].revents)
+            size_t i = nfixed + (rr_start + k) % nconns;
+            Conn *conn = fd2conn[poll_args[i].fd];
+            if (poll_args[i].revents || conn_has_pending_req(conn))
             {
-                Conn *conn = fd2conn[poll_args[i].fd];
-                connection_io(conn);
-                if (conn->state == STATE_END)
+                if (poll_args[i].revents & POLLIN)
                 {
-                    // client closed normally, or something bad happened.
-                    // destroy this connection
-                    fd2conn[conn->fd] = NULL;
-                    (void)close(conn->fd);
-                    free(conn);
+                    conn->t_readable = now_ns; // Start of the request's first phase
                 }
+                if (conn->state == STATE_IO && (poll_args[i].revents & (POLLHUP | POLLERR)))
+                {
+                    // the client went away while a value log read runs;
+                    // nothing reads the socket in this state, so end it here
+                    // rather than have poll report the hangup forever
+                    conn->state = STATE_END;
+                }
+                connection_io(conn);
+            }
+            conn_check_obuf(conn, now_ms);
+            if (conn->state == STATE_END)
+            {
+                // client closed normally, or something bad happened.
+                // destroy this connection
+                conn_destroy(fd2conn, conn);
             }
         }
+        rr_start++;
 
-        // try to accept a new connection if the listening fd is active
-        if (poll_args[0].revents)
+        // try to accept a new connection on every active listening fd
+        for (size_t i = 0; i < nlisten; ++i)
         {
-            (void)accept_new_conn(fd2conn, fd);
+            if (poll_args[i].revents)
+            {
+                (void)accept_new_conn(fd2conn, poll_args[i].fd);
+            }
         }
     }
 
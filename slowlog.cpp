@@ -0,0 +1,208 @@
+//
+// Slowlog and request tracing: follows each request through its phases
+// and keeps the slow ones, optionally writing every request as trace events
+//
+#include "slowlog.h"
+#include "utility.h"
+
+// Structure representing one slowlog entry
+struct SlowEntry
+{
+    uint64_t id = 0; // Increasing id, tells entries apart across resets
+    ReqTrace tr;     // The request and its timestamps
+};
+
+// Global slowlog and trace state
+static struct
+{
+    std::deque<SlowEntry> entries; // Ring buffer, newest first
+    uint64_t next_id = 0;          // Id of the next entry
+    FILE *trace = NULL;            // Trace event output, NULL if off
+    uint64_t trace_flushed_ms = 0; // Last time the trace output was flushed
+} g_slow;
+
+// Opens the trace event file, in the JSON array format of Chrome's
+// about:tracing and Perfetto
+void trace_open(const char *path)
+{
+    g_slow.trace = fopen(path, "w");
+    if (!g_slow.trace)
+        die("trace file");
+    setvbuf(g_slow.trace, NULL, _IOFBF, 1 << 20); // Write in large blocks
+    fputs("[\n", g_slow.trace);                   // The closing bracket is optional
+}
+
+// Returns true if requests should be timestamped at all
+bool trace_enabled()
+{
+    return g_opts.slowlog_max_len > 0 || g_slow.trace;
+}
+
+// Called once a request has executed: enters it in the slowlog right away
+// if it is slow, and keeps following it if it is slow or traced
+void trace_exec(Conn *conn, const std::vector<std::string> &cmd)
+{
+    ReqTrace &tr = conn->cur;
+    tr.slow = g_opts.slowlog_max_len > 0 &&
+              tr.t_executed - tr.t_parsed >= g_opts.slowlog_slower_than * 1000;
+    tr.keep = tr.slow || g_slow.trace;
+    if (!tr.keep)
+        return;
+    tr.conn_id = conn->id;
+    tr.t_readable = conn->t_readable;
+    tr.t_read = conn->t_read;
+    tr.cmd = cmd.empty() ? std::string() : cmd[0];
+    tr.key = cmd.size() > 1 ? cmd[1] : std::string();
+    tr.arg_sizes.clear();
+    for (size_t i = 1; i < cmd.size(); ++i)
+    {
+        tr.arg_sizes.push_back((uint32_t)cmd[i].size());
+    }
+    if (tr.slow)
+    {
+        // Logged now, even if the response is never flushed, e.g. because
+        // the client is cut off by the output limits
+        SlowEntry ent;
+        ent.id = g_slow.next_id++;
+        ent.tr = tr;
+        tr.slow_id = ent.id;
+        g_slow.entries.push_front(std::move(ent));
+        if (g_slow.entries.size() > g_opts.slowlog_max_len)
+            g_slow.entries.pop_back(); // Drop the oldest entry
+    }
+}
+
+// Finds a slowlog entry by id, NULL if it was dropped or reset meanwhile
+static SlowEntry *slow_find(uint64_t id)
+{
+    if (g_slow.entries.empty() || id > g_slow.entries.front().id)
+        return NULL;
+    size_t i = g_slow.entries.front().id - id; // Ids decrease by one from the front
+    if (i >= g_slow.entries.size() || g_slow.entries[i].id != id)
+        return NULL;
+    return &g_slow.entries[i];
+}
+
+// Called once the response of a kept request is in the write buffer
+void trace_queued(Conn *conn)
+{
+    conn->cur.end_off = conn->wbuf_queued;
+    conn->traces.push_back(std::move(conn->cur));
+    conn->cur = ReqTrace();
+}
+
+// Writes a string as a JSON string literal
+static void json_str(FILE *f, const std::string &s)
+{
+    fputc('"', f);
+    for (unsigned char c : s)
+    {
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20 || c >= 0x7f)
+            fprintf(f, "\\u%04x", c); // Keeps binary keys valid JSON
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+// Writes one phase as a complete ("X") trace event
+static void trace_phase(const ReqTrace &tr, const char *name, uint64_t from, uint64_t to)
+{
+    if (!from || to < from)
+        return; // Phase didn't happen, e.g. no read for a request already buffered
+    fprintf(g_slow.trace, "{\"name\":\"%s\",\"cat\":", name);
+    json_str(g_slow.trace, tr.cmd);
+    fprintf(g_slow.trace, ",\"ph\":\"X\",\"pid\":1,\"tid\":%llu,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"key\":",
+            (unsigned long long)tr.conn_id, from / 1000.0, (to - from) / 1000.0);
+    json_str(g_slow.trace, tr.key);
+    fputs("}},\n", g_slow.trace);
+}
+
+// Called after a write: finishes the kept requests whose responses are out
+void trace_flushed(Conn *conn)
+{
+    uint64_t now = get_monotonic_nsec();
+    while (!conn->traces.empty() && conn->traces.front().end_off <= conn->wbuf_flushed)
+    {
+        ReqTrace &tr = conn->traces.front();
+        tr.t_flush = conn->t_flush;
+        tr.t_flushed = now;
+        if (g_slow.trace)
+        {
+            trace_phase(tr, "read", tr.t_readable, tr.t_read);
+            trace_phase(tr, "wait", tr.t_read, tr.t_start);
+            trace_phase(tr, "parse", tr.t_start, tr.t_parsed);
+            trace_phase(tr, "execute", tr.t_parsed, tr.t_executed);
+            trace_phase(tr, "queue", tr.t_executed, tr.t_flush);
+            trace_phase(tr, "flush", tr.t_flush, tr.t_flushed);
+        }
+        SlowEntry *ent = tr.slow ? slow_find(tr.slow_id) : NULL;
+        if (ent)
+        {
+            ent->tr.t_flush = tr.t_flush; // Complete the entry logged at execution
+            ent->tr.t_flushed = tr.t_flushed;
+        }
+        conn->traces.pop_front();
+    }
+}
+
+// Flushes the trace output about once a second
+void trace_cron(uint64_t now_ms)
+{
+    if (g_slow.trace && now_ms - g_slow.trace_flushed_ms >= 1000)
+    {
+        fflush(g_slow.trace);
+        g_slow.trace_flushed_ms = now_ms;
+    }
+}
+
+// Returns the duration of a phase in microseconds, 0 if it didn't happen
+static unsigned long long phase_us(uint64_t from, uint64_t to)
+{
+    return (from && to >= from) ? (to - from) / 1000 : 0;
+}
+
+// Formats up to 'count' of the newest entries, one per line, stopping
+// before the output grows past 'max_size'
+void slowlog_format(size_t count, size_t max_size, std::string *out)
+{
+    for (size_t i = 0; i < count && i < g_slow.entries.size(); ++i)
+    {
+        const SlowEntry &ent = g_slow.entries[i];
+        const ReqTrace &tr = ent.tr;
+        std::string sizes;
+        for (uint32_t sz : tr.arg_sizes)
+        {
+            sizes += (sizes.empty() ? "" : ",") + std::to_string(sz);
+        }
+        char line[256];
+        snprintf(line, sizeof(line),
+                 " args=%s start=%lluus read=%lluus wait=%lluus parse=%lluus"
+                 " exec=%lluus queue=%lluus flush=%lluus",
+                 sizes.empty() ? "-" : sizes.c_str(),
+                 (unsigned long long)(tr.t_start / 1000),
+                 phase_us(tr.t_readable, tr.t_read), phase_us(tr.t_read, tr.t_start),
+                 phase_us(tr.t_start, tr.t_parsed), phase_us(tr.t_parsed, tr.t_executed),
+                 phase_us(tr.t_executed, tr.t_flush), phase_us(tr.t_flush, tr.t_flushed));
+        std::string entry = std::to_string(ent.id) + " " + tr.cmd + " " + tr.key + line;
+        if (out->size() + !out->empty() + entry.size() > max_size)
+            break; // Keep the response within the message size
+        if (!out->empty())
+            out->push_back('\n');
+        out->append(entry);
+    }
+}
+
+// Returns the number of entries in the slowlog
+size_t slowlog_len()
+{
+    return g_slow.entries.size();
+}
+
+// Empties the slowlog
+void slowlog_reset()
+{
+    g_slow.entries.clear();
+}
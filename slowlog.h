@@ -0,0 +1,32 @@
+//
+// Slowlog and request tracing: follows each request through its phases
+// and keeps the slow ones, optionally writing every request as trace events
+//
+#include <cstdint> // For fixed-width integer types
+#include <string>  // For std::string class
+#include <vector>  // For std::vector container
+
+#include "types.h"
+
+#ifndef FII_DB_SLOWLOG_H
+#define FII_DB_SLOWLOG_H
+
+void trace_open(const char *path);
+
+bool trace_enabled();
+
+void trace_exec(Conn *conn, const std::vector<std::string> &cmd);
+
+void trace_queued(Conn *conn);
+
+void trace_flushed(Conn *conn);
+
+void trace_cron(uint64_t now_ms);
+
+void slowlog_format(size_t count, size_t max_size, std::string *out);
+
+size_t slowlog_len();
+
+void slowlog_reset();
+
+#endif // FII_DB_SLOWLOG_H
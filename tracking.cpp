@@ -0,0 +1,103 @@
+//
+// Server-assisted client-side caching: remembers which connections read
+// which keys and pushes an invalidation when one of those keys changes
+//
+#include <algorithm>     // For std::find
+#include <unordered_map> // For std::unordered_map container
+#include <vector>        // For std::vector container
+
+#include "tracking.h"
+#include "utility.h"
+
+// Global tracking state
+static struct
+{
+    std::unordered_map<std::string, std::vector<uint64_t>> keys; // Key -> ids of connections that read it
+    std::unordered_map<uint64_t, Conn *> conns;                  // Id -> connection, for tracking connections
+} g_track;
+
+// Sends an invalidation for 'key' to every connection that read it, and
+// stops tracking the key until it is read again
+static void invalidate(std::unordered_map<std::string, std::vector<uint64_t>>::iterator it)
+{
+    for (uint64_t id : it->second)
+    {
+        auto c = g_track.conns.find(id);
+        if (c != g_track.conns.end())
+        {
+            c->second->tracked.erase(it->first);
+            conn_queue_push(c->second, {"invalidate", it->first});
+        }
+    }
+    g_track.keys.erase(it);
+}
+
+// Removes a connection from the readers of every key it has read
+static void untrack_all(Conn *conn)
+{
+    for (const std::string &key : conn->tracked)
+    {
+        auto it = g_track.keys.find(key);
+        std::vector<uint64_t> &ids = it->second;
+        ids.erase(std::find(ids.begin(), ids.end(), conn->id));
+        if (ids.empty())
+        {
+            g_track.keys.erase(it); // Drop the key along with its last reader
+        }
+    }
+    conn->tracked.clear();
+}
+
+// Turns tracking on or off for a connection
+void tracking_enable(Conn *conn, bool on)
+{
+    conn->tracking = on;
+    if (on)
+    {
+        g_track.conns[conn->id] = conn;
+    }
+    else
+    {
+        untrack_all(conn);
+        g_track.conns.erase(conn->id);
+    }
+}
+
+// Records that a tracking connection has read 'key'
+void tracking_track(Conn *conn, const std::string &key)
+{
+    if (!conn->tracking || conn->tracked.count(key))
+        return; // Not tracking, or already tracked for this connection
+    auto it = g_track.keys.find(key);
+    if (it == g_track.keys.end())
+    {
+        if (g_opts.tracking_max_keys && g_track.keys.size() >= g_opts.tracking_max_keys)
+        {
+            invalidate(g_track.keys.begin()); // Table full: make clients drop some key instead
+        }
+        it = g_track.keys.emplace(key, std::vector<uint64_t>()).first;
+    }
+    it->second.push_back(conn->id);
+    conn->tracked.insert(key);
+}
+
+// Called when 'key' is modified or deleted
+void tracking_invalidate(const std::string &key)
+{
+    if (g_track.keys.empty())
+        return;
+    auto it = g_track.keys.find(key);
+    if (it != g_track.keys.end())
+    {
+        invalidate(it);
+    }
+}
+
+// Called when a connection is closed
+void tracking_forget(Conn *conn)
+{
+    if (conn->tracking)
+    {
+        tracking_enable(conn, false);
+    }
+}
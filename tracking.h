@@ -0,0 +1,21 @@
+//
+// Server-assisted client-side caching: remembers which connections read
+// which keys and pushes an invalidation when one of those keys changes
+//
+#include <cstdint> // For fixed-width integer types
+#include <string>  // For std::string class
+
+#include "types.h"
+
+#ifndef FII_DB_TRACKING_H
+#define FII_DB_TRACKING_H
+
+void tracking_enable(Conn *conn, bool on);
+
+void tracking_track(Conn *conn, const std::string &key);
+
+void tracking_invalidate(const std::string &key);
+
+void tracking_forget(Conn *conn);
+
+#endif // FII_DB_TRACKING_H
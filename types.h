@@ -7,43 +7,164 @@
 #include <cstdint> // For fixed-width integer types
 #include <cstdlib> // For standard library functions like malloc
 #include <map>     // For std::map container
+#include <vector>  // For std::vector container
+#include <memory>  // For std::unique_ptr
+#include <unordered_map> // For std::unordered_map container
+#include <deque>   // For std::deque container
+#include <unordered_set> // For std::unordered_set container
+#include <utility> // For std::pair
+
+#include "hash.h"
 
 #ifndef FII_DB_TYPES_H
 #define FII_DB_TYPES_H
-// Define maximum message size for simplicity in handling buffers
-const size_t k_max_msg = 4096;
+// Define maximum message size, which also bounds the size of a value
+const size_t k_max_msg = 16 * 1024 * 1024;
+
+// Initial size of a connection's read buffer, grown for larger requests
+const size_t k_rbuf_init = 4 + 4096;
+
+// Address the server listens on when no --listen option is given
+const char *const k_default_addr = "0.0.0.0:1234";
 
 // Maximum number of arguments in a command
 const size_t k_max_args = 1024;
 
+// Maximum number of buffers handed to one writev() call
+const int k_max_iov = 64;
+
+// Enumeration for the types of values stored under a key
+enum VALUE_TYPES
+{
+    T_STR = 0,  // Plain string value
+    T_HASH = 1, // Hash of fields to values
+};
+
+// Structure representing a value in the keyspace
+struct Entry
+{
+    uint32_t type = T_STR;         // Type of the value (using the enum above)
+    std::string str;               // Value of a string entry
+    std::unique_ptr<HashObj> hash; // Value of a hash entry
+    bool hot = false;              // Accessed since the last eviction sweep passed this entry
+    bool spilled = false;          // True if the string value lives in the value log
+    bool spilling = false;         // True while the string value is being written to the value log
+    uint32_t vseg = 0;             // Value log segment holding a spilled or spilling value
+    uint32_t voff = 0;             // Offset of that value within its segment
+    uint32_t vlen = 0;             // Length of that value
+    uint32_t pins = 0;             // Requests that need the value to stay in memory
+    uint64_t pin_gen = 0;          // Tells this entry from a later one with the same key (0 = never pinned)
+};
+
 // Global map to store key-value pairs, acting as a simple database
-static std::map<std::string, std::string> g_map;
+extern std::map<std::string, Entry> g_map;
+
+// Server tunables, filled from the command line at startup
+struct ServerOptions
+{
+    uint32_t max_reqs_per_io = 32;             // Requests served per connection per event loop iteration
+    size_t max_bytes_per_io = 64 * 1024;       // Request bytes served per connection per event loop iteration
+    size_t obuf_pause = 256 * 1024;            // Stop reading from a client once this much output is queued
+    size_t obuf_soft_limit = 8 * 1024 * 1024;  // Disconnect if queued output stays above this for too long (0 = off)
+    uint64_t obuf_soft_secs = 60;              // How long the soft limit may be exceeded before disconnecting
+    size_t obuf_hard_limit = 32 * 1024 * 1024; // Disconnect as soon as queued output exceeds this (0 = off)
+    std::vector<std::string> listen;           // Listener addresses, "host:port" or "unix:/path"
+    int sndbuf = 0;                            // SO_SNDBUF for accepted sockets (0 = kernel default)
+    int rcvbuf = 0;                            // SO_RCVBUF for accepted sockets (0 = kernel default)
+    std::string vlog_dir;                      // Directory of the value log, enables tiered storage
+    size_t vlog_max_mem = 1024 * 1024 * 1024;  // String value bytes kept in memory before spilling
+    size_t tracking_max_keys = 1024 * 1024;    // Keys remembered for client-side caching (0 = no limit)
+    uint64_t slowlog_slower_than = 10000;      // Execution time (us) above which a request is logged
+    size_t slowlog_max_len = 128;              // Entries kept in the slowlog (0 = slowlog off)
+    std::string trace_file;                    // Where to write trace events, empty = off
+};
+
+// Global server options
+extern ServerOptions g_opts;
 
 enum CONNECTION_STATE
 {
     STATE_REQ = 0, // State indicating waiting for a request
-    STATE_RES = 1, // State indicating sending a response
+    STATE_RES = 1, // State indicating draining queued responses, reads are paused
     STATE_END = 2, // State indicating the connection should be closed
+    STATE_IO = 3,  // State indicating a reply is waiting on a value log read
 };
 
 // Enumeration for response codes
 enum RESPONSE_CODES
 {
-    RES_OK = 0,  // Indicates a successful operation
-    RES_ERR = 1, // Indicates an error occurred
-    RES_NX = 2,  // Indicates a non-existent item
+    RES_OK = 0,   // Indicates a successful operation
+    RES_ERR = 1,  // Indicates an error occurred
+    RES_NX = 2,   // Indicates a non-existent item
+    RES_PUSH = 3, // Out-of-band message sent without a request, e.g. an invalidation
+
+    RES_DEFER = 255, // Internal: the reply is queued later by the value log, never sent
+    RES_RETRY = 254, // Internal: run the request again once the value log has loaded a value
+};
+
+// Structure holding the timestamps (ns, monotonic) of one request's phases
+struct ReqTrace
+{
+    uint64_t conn_id = 0;             // Connection the request came from
+    std::string cmd;                  // Command name
+    std::string key;                  // First argument, usually the key
+    std::vector<uint32_t> arg_sizes;  // Size of every argument
+    uint64_t t_readable = 0;          // poll() reported the socket readable
+    uint64_t t_read = 0;              // read() returned the last bytes of the request
+    uint64_t t_start = 0;             // Parsing started
+    uint64_t t_parsed = 0;            // Parsing (parse_req) finished
+    uint64_t t_executed = 0;          // Execution (do_request) finished
+    uint64_t t_flush = 0;             // The flush that sent the response started
+    uint64_t t_flushed = 0;           // Last byte of the response written to the socket
+    uint64_t end_off = 0;             // Bytes queued on the connection up to the end of the response
+    bool keep = false;                // Slow or traced, so it must be followed up to the flush
+    bool slow = false;                // Recorded in the slowlog, under slow_id
+    uint64_t slow_id = 0;             // Id of its slowlog entry, whose flush times are filled in later
+};
+
+// Structure representing a frame shared by the output queues of several
+// connections, such as a published message
+struct SharedOut
+{
+    size_t at = 0;                          // Write buffer offset the frame goes out at
+    std::shared_ptr<const std::string> buf; // The whole frame, header included
 };
 
 // Structure representing a network connection
 struct Conn
 {
-    int fd = -1;                 // File descriptor for the connection socket
-    uint32_t state = 0;          // Current state of the connection (using the enum above)
-    size_t rbuf_size = 0;        // Size of the data currently in the read buffer
-    uint8_t rbuf[4 + k_max_msg]; // Read buffer, with space for message length and data
-    size_t wbuf_size = 0;        // Size of the data currently in the write buffer
-    size_t wbuf_sent = 0;        // Amount of data already sent from the write buffer
-    uint8_t wbuf[4 + k_max_msg]; // Write buffer, with space for message length and data
+    int fd = -1;                  // File descriptor for the connection socket
+    uint64_t id = 0;              // Unique id, tells a reused fd apart from a closed connection
+    uint32_t state = 0;           // Current state of the connection (using the enum above)
+    size_t rbuf_size = 0;         // Size of the data currently in the read buffer
+    std::vector<uint8_t> rbuf;    // Read buffer, grown to fit the message length and data
+    size_t wbuf_sent = 0;         // Amount of data already sent from the write buffer
+    std::vector<uint8_t> wbuf;    // Write buffer, holding every queued response in order
+    std::deque<SharedOut> wshared; // Shared frames, each sent once wbuf reaches its offset
+    size_t wshared_sent = 0;      // Amount of the first shared frame already sent
+    size_t wshared_bytes = 0;     // Unsent bytes of all shared frames
+    uint64_t obuf_soft_since = 0; // Time (ms) the output first exceeded the soft limit, 0 if below
+    bool tracking = false;        // Keys read by this connection are tracked for invalidation
+    std::unordered_set<std::string> tracked; // Keys this connection is tracked for
+    std::string held_pushes;      // Push frames held back while a reply waits on the value log
+    std::vector<std::pair<std::string, uint64_t>> pinned; // Keys, with their entry's pin_gen, kept in memory until the current request finishes
+    std::unordered_set<std::string> channels; // Channels this connection is subscribed to
+    std::unordered_set<std::string> patterns; // Channel patterns this connection is subscribed to
+    uint64_t wbuf_queued = 0;     // Bytes ever queued in the write buffer
+    uint64_t wbuf_flushed = 0;    // Bytes ever written from the write buffer
+    uint64_t t_readable = 0;      // Last time poll() reported the socket readable
+    uint64_t t_read = 0;          // Last time read() returned data
+    uint64_t t_flush = 0;         // Start of the current flush
+    ReqTrace cur;                 // Timestamps of the request being served
+    std::deque<ReqTrace> traces;  // Slow or traced requests whose responses aren't flushed yet
+};
+
+// Structure representing a client-side cache kept valid by invalidation pushes
+struct NearCache
+{
+    int fd = -1;                                       // Connection to the server, with tracking on
+    size_t max_keys = 10000;                           // Values kept locally (0 = no limit)
+    std::unordered_map<std::string, std::string> vals; // Cached values, keyed by key
 };
 
 #endif // FII_DB_TYPES_H
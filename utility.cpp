@@ -3,6 +3,17 @@
 //
 #include "utility.h"
 #include "types.h"
+#include "vlog.h"
+#include "tracking.h"
+#include "slowlog.h"
+#include "bitops.h"
+#include "pubsub.h"
+
+// Global map to store key-value pairs, acting as a simple database
+std::map<std::string, Entry> g_map;
+
+// Global server options, overridden from the command line by the server
+ServerOptions g_opts;
 
 // Prints a message to standard error
 void msg(const char *msg)
@@ -39,6 +50,148 @@ void fd_set_nb(int fd)
     }
 }
 
+// Returns a monotonic timestamp in milliseconds
+uint64_t get_monotonic_msec()
+{
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);                                // Unaffected by wall-clock changes
+    return uint64_t(tv.tv_sec) * 1000 + uint64_t(tv.tv_nsec) / 1000000; // Convert to milliseconds
+}
+
+// Returns a monotonic timestamp in nanoseconds. CLOCK_MONOTONIC is read
+// through the vDSO without a system call, cheap enough for every request
+uint64_t get_monotonic_nsec()
+{
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + uint64_t(tv.tv_nsec);
+}
+
+// Parses "host:port", "[v6-host]:port" or "unix:/path" into a socket address
+int32_t parse_addr(const char *spec, struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+    memset(addr, 0, sizeof(*addr));
+    if (0 == strncmp(spec, "unix:", 5))
+    {
+        struct sockaddr_un *un = (struct sockaddr_un *)addr;
+        const char *path = spec + 5;
+        if (!*path || strlen(path) >= sizeof(un->sun_path))
+            return -1; // Return error if the path is empty or doesn't fit
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, path);
+        *addrlen = sizeof(*un);
+        return 0;
+    }
+
+    const char *colon = strrchr(spec, ':'); // The port follows the last colon
+    if (!colon)
+        return -1;
+    std::string host(spec, colon - spec);
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+    {
+        host = host.substr(1, host.size() - 2); // Strip the brackets of an IPv6 address
+    }
+    char *end = NULL;
+    unsigned long port = strtoul(colon + 1, &end, 10);
+    if (end == colon + 1 || *end != '\0' || port > 65535)
+        return -1; // Return error if the port is not a number in range
+
+    struct sockaddr_in *in4 = (struct sockaddr_in *)addr;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+    if (1 == inet_pton(AF_INET, host.c_str(), &in4->sin_addr))
+    {
+        in4->sin_family = AF_INET;
+        in4->sin_port = htons((uint16_t)port);
+        *addrlen = sizeof(*in4);
+        return 0;
+    }
+    if (1 == inet_pton(AF_INET6, host.c_str(), &in6->sin6_addr))
+    {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons((uint16_t)port);
+        *addrlen = sizeof(*in6);
+        return 0;
+    }
+    return -1; // Return error if the host is not a numeric address
+}
+
+// Creates a non-blocking listening socket for the given address
+int listen_on(const char *spec)
+{
+    struct sockaddr_storage addr = {};
+    socklen_t addrlen = 0;
+    if (parse_addr(spec, &addr, &addrlen))
+    {
+        fprintf(stderr, "bad listen address: %s\n", spec);
+        exit(1);
+    }
+
+    int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        die("socket()");
+    }
+    if (addr.ss_family == AF_UNIX)
+    {
+        const char *path = ((struct sockaddr_un *)&addr)->sun_path;
+        struct stat st = {};
+        if (0 == lstat(path, &st))
+        {
+            if (!S_ISSOCK(st.st_mode))
+            {
+                fprintf(stderr, "not a socket, refusing to replace: %s\n", path);
+                exit(1);
+            }
+            (void)unlink(path); // Remove a stale socket file left by a previous run
+        }
+    }
+    else
+    {
+        int val = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    }
+
+    if (bind(fd, (const struct sockaddr *)&addr, addrlen))
+    {
+        die("bind()");
+    }
+    if (listen(fd, SOMAXCONN))
+    {
+        die("listen()");
+    }
+    fd_set_nb(fd); // Set the listen fd to non-blocking mode
+    return fd;
+}
+
+// Connects a blocking socket to the given address, returns -1 on failure
+int connect_to(const char *spec)
+{
+    struct sockaddr_storage addr = {};
+    socklen_t addrlen = 0;
+    if (parse_addr(spec, &addr, &addrlen))
+    {
+        msg("bad address");
+        return -1;
+    }
+
+    int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (connect(fd, (const struct sockaddr *)&addr, addrlen))
+    {
+        close(fd);
+        return -1;
+    }
+    if (addr.ss_family != AF_UNIX)
+    {
+        int val = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val)); // Send small requests right away
+    }
+    return fd;
+}
+
 // Maps a file descriptor to its corresponding connection object
 void conn_put(std::vector<Conn *> &fd2conn, struct Conn *conn)
 {
@@ -52,7 +205,7 @@ void conn_put(std::vector<Conn *> &fd2conn, struct Conn *conn)
 // Accepts a new connection, initializes a Conn struct for it, and stores it in fd2conn
 int32_t accept_new_conn(std::vector<Conn *> &fd2conn, int fd)
 {
-    struct sockaddr_in client_addr = {};                                // Client address structure
+    struct sockaddr_storage client_addr = {};                           // Client address structure, TCP or Unix
     socklen_t socklen = sizeof(client_addr);                            // Length of the client address structure
     int connfd = accept(fd, (struct sockaddr *)&client_addr, &socklen); // Accept new connection
     if (connfd < 0)
@@ -63,23 +216,41 @@ int32_t accept_new_conn(std::vector<Conn *> &fd2conn, int fd)
 
     fd_set_nb(connfd); // Set the new connection to non-blocking mode
 
-    struct Conn *conn = (struct Conn *)malloc(sizeof(struct Conn)); // Allocate memory for new connection
-    if (!conn)
-    {                  // If malloc failed
-        close(connfd); // Close the connection file descriptor
-        return -1;     // Return error code
+    if (client_addr.ss_family == AF_INET || client_addr.ss_family == AF_INET6)
+    {
+        int val = 1;
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val)); // Don't delay small replies
+    }
+    if (g_opts.sndbuf > 0)
+    {
+        setsockopt(connfd, SOL_SOCKET, SO_SNDBUF, &g_opts.sndbuf, sizeof(g_opts.sndbuf));
+    }
+    if (g_opts.rcvbuf > 0)
+    {
+        setsockopt(connfd, SOL_SOCKET, SO_RCVBUF, &g_opts.rcvbuf, sizeof(g_opts.rcvbuf));
     }
-    // Initialize the connection structure
+
+    static uint64_t next_id = 0;
+    struct Conn *conn = new Conn(); // Allocate and default-initialize the new connection
     conn->fd = connfd;
+    conn->id = ++next_id;
     conn->state = STATE_REQ;
-    conn->rbuf_size = 0;
-    conn->wbuf_size = 0;
-    conn->wbuf_sent = 0;
 
     conn_put(fd2conn, conn); // Store the connection in the map
     return 0;                // Return success code
 }
 
+// Closes a connection and frees everything that refers to it
+void conn_destroy(std::vector<Conn *> &fd2conn, Conn *conn)
+{
+    fd2conn[conn->fd] = NULL; // Remove the connection from the map
+    (void)close(conn->fd);    // Close the connection file descriptor
+    tracking_forget(conn);    // Stop sending invalidations to it
+    pubsub_forget(conn);      // And published messages
+    vlog_unpin(conn);         // Release values a waiting request had loaded
+    delete conn;              // Free the connection structure
+}
+
 // Parses a request from a client, extracting the arguments
 int32_t parse_req(
     const uint8_t *data, size_t len, std::vector<std::string> &out)
@@ -109,37 +280,508 @@ int32_t parse_req(
     return 0;      // Return success
 }
 
+// Writes an error message as the response body and returns the error code
+static uint32_t out_err(const char *msg, std::string &out)
+{
+    out = msg;      // Copy error message to response body
+    return RES_ERR; // Return error code
+}
+
+// Writes a decimal integer as the response body and returns success
+static uint32_t out_int(int64_t val, std::string &out)
+{
+    out = std::to_string(val);
+    return RES_OK;
+}
+
+// Parses a whole string as a signed 64-bit integer
+static bool str2int(const std::string &s, int64_t *out)
+{
+    char *end = NULL;
+    errno = 0;
+    long long val = strtoll(s.c_str(), &end, 10);
+    if (errno || s.empty() || end != s.c_str() + s.size())
+        return false; // Not a number, trailing garbage, or out of range
+    *out = (int64_t)val;
+    return true;
+}
+
 // Handles 'get' command by retrieving the value for the given key
 uint32_t do_get(
-    const std::vector<std::string> &cmd, uint8_t *res, uint32_t *reslen)
+    Conn *conn, const std::vector<std::string> &cmd, std::string &out)
 {
-    if (!g_map.count(cmd[1]))
-        return RES_NX;                   // Return non-existent if key not found
-    std::string &val = g_map[cmd[1]];    // Retrieve the value for the key
+    tracking_track(conn, cmd[1]); // Missing keys are tracked too, the client may cache that
+    auto it = g_map.find(cmd[1]);
+    if (it == g_map.end())
+        return RES_NX; // Return non-existent if key not found
+    if (it->second.type != T_STR)
+        return out_err("wrong type", out); // Only string values can be read with 'get'
+    if (it->second.spilled)
+        return vlog_get(conn, cmd[1], it->second, out); // The value is in the value log
+    it->second.hot = true;               // Recently read, keep it in memory
+    std::string &val = it->second.str;   // Retrieve the value for the key
     assert(val.size() <= k_max_msg);     // Ensure the value size is within the maximum message size
-    memcpy(res, val.data(), val.size()); // Copy the value to the response buffer
-    *reslen = (uint32_t)val.size();      // Set the response length
+    out = val;                           // Copy the value to the response body
     return RES_OK;                       // Return success code
 }
 
 // Handles 'set' command by storing the given key-value pair
 uint32_t do_set(
-    const std::vector<std::string> &cmd, uint8_t *res, uint32_t *reslen)
+    const std::vector<std::string> &cmd, std::string &out)
 {
-    (void)res;              // Unused parameter, avoid compiler warnings
-    (void)reslen;           // Unused parameter, avoid compiler warnings
-    g_map[cmd[1]] = cmd[2]; // Set the value for the key in the map
-    return RES_OK;          // Return success code
+    (void)out;                     // Unused parameter, avoid compiler warnings
+    Entry &ent = g_map[cmd[1]];    // Find or create the entry for the key
+    vlog_untrack(ent);             // Forget the old value, in memory or spilled
+    ent.type = T_STR;              // 'set' replaces a value of any type
+    ent.str = cmd[2];              // Set the value for the key in the map
+    ent.hash.reset();              // Free a hash previously stored under the key
+    vlog_track(ent);               // Count the new value against the memory budget
+    tracking_invalidate(cmd[1]);   // Tell caching clients the value changed
+    return RES_OK;                 // Return success code
 }
 
 // Handles 'del' command by removing the given key-value pair
 uint32_t do_del(
-    const std::vector<std::string> &cmd, uint8_t *res, uint32_t *reslen)
+    const std::vector<std::string> &cmd, std::string &out)
+{
+    (void)out;           // Unused parameter, avoid compiler warnings
+    auto it = g_map.find(cmd[1]);
+    if (it != g_map.end())
+    {
+        vlog_untrack(it->second);    // Forget the value, in memory or spilled
+        g_map.erase(it);             // Remove the key from the map
+        tracking_invalidate(cmd[1]); // Tell caching clients the key is gone
+    }
+    return RES_OK; // Return success code
+}
+
+// Finds the hash stored under a key. Returns NULL and sets *wrong if the
+// key holds another type; creates an empty hash if 'create' is set
+static HashObj *lookup_hash(const std::string &key, bool create, bool *wrong)
+{
+    *wrong = false;
+    auto it = g_map.find(key);
+    if (it == g_map.end())
+    {
+        if (!create)
+            return NULL;
+        Entry &ent = g_map[key];
+        ent.type = T_HASH;
+        ent.hash.reset(new HashObj());
+        return ent.hash.get();
+    }
+    if (it->second.type != T_HASH)
+    {
+        *wrong = true;
+        return NULL;
+    }
+    return it->second.hash.get();
+}
+
+// Handles 'hset key field value', responding with 1 if the field is new
+uint32_t do_hset(
+    const std::vector<std::string> &cmd, std::string &out)
+{
+    bool wrong = false;
+    HashObj *h = lookup_hash(cmd[1], true, &wrong);
+    if (wrong)
+        return out_err("wrong type", out);
+    bool added = hash_set(h, cmd[2], cmd[3]);
+    tracking_invalidate(cmd[1]);
+    return out_int(added ? 1 : 0, out);
+}
+
+// Handles 'hget key field' by retrieving the value of one field
+uint32_t do_hget(
+    Conn *conn, const std::vector<std::string> &cmd, std::string &out)
 {
-    (void)res;           // Unused parameter, avoid compiler warnings
-    (void)reslen;        // Unused parameter, avoid compiler warnings
-    g_map.erase(cmd[1]); // Remove the key from the map
-    return RES_OK;       // Return success code
+    tracking_track(conn, cmd[1]);
+    bool wrong = false;
+    HashObj *h = lookup_hash(cmd[1], false, &wrong);
+    if (wrong)
+        return out_err("wrong type", out);
+    if (!h || !hash_get(h, cmd[2], &out))
+        return RES_NX; // Return non-existent if the key or field is not found
+    return RES_OK;
+}
+
+// Handles 'hdel key field', responding with 1 if the field was removed
+uint32_t do_hdel(
+    const std::vector<std::string> &cmd, std::string &out)
+{
+    bool wrong = false;
+    HashObj *h = lookup_hash(cmd[1], false, &wrong);
+    if (wrong)
+        return out_err("wrong type", out);
+    bool removed = h && hash_del(h, cmd[2]);
+    if (h && hash_len(h) == 0)
+    {
+        g_map.erase(cmd[1]); // Drop the key along with its last field
+    }
+    if (removed)
+    {
+        tracking_invalidate(cmd[1]);
+    }
+    return out_int(removed ? 1 : 0, out);
+}
+
+// Handles 'hgetall key', responding with the fields and values in the
+// request encoding: the number of strings, then each length-prefixed string
+uint32_t do_hgetall(
+    Conn *conn, const std::vector<std::string> &cmd, std::string &out)
+{
+    tracking_track(conn, cmd[1]);
+    bool wrong = false;
+    HashObj *h = lookup_hash(cmd[1], false, &wrong);
+    if (wrong)
+        return out_err("wrong type", out);
+    if (!h)
+        return RES_NX; // Return non-existent if key not found
+    uint32_t n = 0;
+    out.assign(4, '\0'); // Number of strings, filled in below
+    auto put = [&out, &n](std::string_view str) {
+        uint32_t len = (uint32_t)str.size();
+        out.append((const char *)&len, 4); // Length of the string
+        out.append(str);
+        n++;
+    };
+    hash_foreach(h, [&put](std::string_view f, std::string_view v) {
+        put(f);
+        put(v);
+    });
+    memcpy(&out[0], &n, 4);
+    if (out.size() > k_max_msg)
+        return out_err("response too big", out);
+    return RES_OK;
+}
+
+// Handles 'hincrby key field incr', responding with the new value
+uint32_t do_hincrby(
+    const std::vector<std::string> &cmd, std::string &out)
+{
+    int64_t incr = 0;
+    if (!str2int(cmd[3], &incr))
+        return out_err("not an integer", out);
+    bool wrong = false;
+    HashObj *h = lookup_hash(cmd[1], true, &wrong);
+    if (wrong)
+        return out_err("wrong type", out);
+    int64_t val = 0;
+    std::string cur;
+    if (hash_get(h, cmd[2], &cur) && !str2int(cur, &val))
+        return out_err("field is not an integer", out);
+    if (__builtin_add_overflow(val, incr, &val))
+        return out_err("increment would overflow", out);
+    hash_set(h, cmd[2], std::to_string(val));
+    tracking_invalidate(cmd[1]);
+    return out_int(val, out);
+}
+
+// Finds the string stored under a key for a bit command, loading it back
+// from the value log first. Returns false with the response code in *code
+// if the command can't go on; *ent is NULL for a missing key
+static bool lookup_bits(
+    Conn *conn, const std::string &key, Entry **ent, uint32_t *code, std::string &out)
+{
+    *ent = NULL;
+    auto it = g_map.find(key);
+    if (it == g_map.end())
+        return true; // A missing key reads as an empty bitmap
+    if (it->second.type != T_STR)
+    {
+        *code = out_err("wrong type", out);
+        return false;
+    }
+    if (!vlog_load(conn, key, it->second))
+    {
+        *code = RES_RETRY; // The request runs again once the value is in memory
+        return false;
+    }
+    it->second.hot = true;
+    *ent = &it->second;
+    return true;
+}
+
+// Parses a bit offset, which must address a bit within the largest value
+static bool parse_bit_offset(const std::string &s, uint64_t *off)
+{
+    int64_t val = 0;
+    if (!str2int(s, &val) || val < 0 || (uint64_t)val >= (uint64_t)k_max_msg * 8)
+        return false;
+    *off = (uint64_t)val;
+    return true;
+}
+
+// Turns an inclusive byte range, where negative indexes count from the end,
+// into [*start, *end). Returns false if an index is not a number
+static bool parse_byte_range(
+    const std::string &s1, const std::string &s2, size_t len, size_t *start, size_t *end)
+{
+    int64_t a = 0, b = 0;
+    if (!str2int(s1, &a) || !str2int(s2, &b))
+        return false;
+    if (a < 0)
+        a = std::max<int64_t>(a + (int64_t)len, 0);
+    if (b < 0)
+        b = std::max<int64_t>(b + (int64_t)len, -1);
+    a = std::min<int64_t>(a, (int64_t)len); // Never start past the value
+    b = std::min<int64_t>(b, (int64_t)len - 1);
+    *start = (size_t)a;
+    *end = (a <= b) ? (size_t)b + 1 : *start; // Empty if the range is inverted or past the end
+    return true;
+}
+
+// Handles 'setbit key offset 0|1', responding with the previous bit.
+// Bit 0 is the most significant bit of the first byte; the value is
+// zero-extended to reach the offset
+uint32_t do_setbit(
+    Conn *conn, const std::vector<std::string> &cmd, std::string &out)
+{
+    uint64_t off = 0;
+    if (!parse_bit_offset(cmd[2], &off))
+        return out_err("bit offset is not an integer or out of range", out);
+    if (cmd[3] != "0" && cmd[3] != "1")
+        return out_err("bit is not 0 or 1", out);
+    Entry *ent = NULL;
+    uint32_t code = RES_OK;
+    if (!lookup_bits(conn, cmd[1], &ent, &code, out))
+        return code;
+    if (!ent)
+    {
+        ent = &g_map[cmd[1]]; // A new key starts out as an empty string
+        ent->type = T_STR;
+    }
+    vlog_untrack(*ent); // The value changes size
+    std::string &val = ent->str;
+    size_t byte = off >> 3;
+    if (val.size() <= byte)
+    {
+        val.resize(byte + 1, '\0');
+    }
+    uint8_t mask = 0x80 >> (off & 7);
+    int old = ((uint8_t)val[byte] & mask) ? 1 : 0;
+    if (cmd[3] == "1")
+        val[byte] = (char)((uint8_t)val[byte] | mask);
+    else
+        val[byte] = (char)((uint8_t)val[byte] & ~mask);
+    vlog_track(*ent);
+    tracking_invalidate(cmd[1]);
+    return out_int(old, out);
+}
+
+// Handles 'getbit key offset'; bits past the end of the value are 0
+uint32_t do_getbit(
+    Conn *conn, const std::vector<std::string> &cmd, std::string &out)
+{
+    uint64_t off = 0;
+    if (!parse_bit_offset(cmd[2], &off))
+        return out_err("bit offset is not an integer or out of range", out);
+    tracking_track(conn, cmd[1]);
+    Entry *ent = NULL;
+    uint32_t code = RES_OK;
+    if (!lookup_bits(conn, cmd[1], &ent, &code, out))
+        return code;
+    size_t byte = off >> 3;
+    if (!ent || ent->str.size() <= byte)
+        return out_int(0, out);
+    uint8_t mask = 0x80 >> (off & 7);
+    return out_int(((uint8_t)ent->str[byte] & mask) ? 1 : 0, out);
+}
+
+// Handles 'bitcount key [start end]', counting the set bits of the whole
+// value or of an inclusive byte range
+uint32_t do_bitcount(
+    Conn *conn, const std::vector<std::string> &cmd, std::string &out)
+{
+    tracking_track(conn, cmd[1]);
+    Entry *ent = NULL;
+    uint32_t code = RES_OK;
+    if (!lookup_bits(conn, cmd[1], &ent, &code, out))
+        return code;
+    const std::string empty;
+    const std::string &val = ent ? ent->str : empty;
+    size_t start = 0, end = val.size();
+    if (cmd.size() == 4 && !parse_byte_range(cmd[2], cmd[3], val.size(), &start, &end))
+        return out_err("not an integer", out);
+    uint64_t n = bits_count((const uint8_t *)val.data() + start, end - start);
+    return out_int((int64_t)n, out);
+}
+
+// Handles 'bitpos key 0|1 [start [end]]', responding with the position of
+// the first bit with the given value in an inclusive byte range, or -1.
+// Without an end, the value is treated as followed by zeros
+uint32_t do_bitpos(
+    Conn *conn, const std::vector<std::string> &cmd, std::string &out)
+{
+    if (cmd[2] != "0" && cmd[2] != "1")
+        return out_err("bit is not 0 or 1", out);
+    bool want = cmd[2] == "1";
+    tracking_track(conn, cmd[1]);
+    Entry *ent = NULL;
+    uint32_t code = RES_OK;
+    if (!lookup_bits(conn, cmd[1], &ent, &code, out))
+        return code;
+    if (!ent)
+        return out_int(want ? -1 : 0, out); // All zeros
+    const std::string &val = ent->str;
+    size_t start = 0, end = val.size();
+    if (cmd.size() >= 4)
+    {
+        const std::string &last = (cmd.size() == 5) ? cmd[4] : std::string("-1");
+        if (!parse_byte_range(cmd[3], last, val.size(), &start, &end))
+            return out_err("not an integer", out);
+    }
+    if (start >= end)
+        return out_int(-1, out);
+    const uint8_t *p = (const uint8_t *)val.data();
+    uint8_t skip = want ? 0x00 : 0xff; // Bytes that can't hold the bit
+    size_t i = start + bits_skip_bytes(p + start, end - start, skip);
+    if (i < end)
+    {
+        uint8_t b = want ? p[i] : (uint8_t)~p[i];
+        return out_int((int64_t)(i * 8) + __builtin_clz(b) - 24, out);
+    }
+    if (!want && cmd.size() < 5)
+        return out_int((int64_t)(end * 8), out); // The first zero past the value
+    return out_int(-1, out);
+}
+
+// Handles 'bitop and|or|xor dest src...', storing the result in dest and
+// responding with its length. Shorter sources are padded with zeros
+uint32_t do_bitop(
+    Conn *conn, const std::vector<std::string> &cmd, std::string &out)
+{
+    uint32_t op = 0;
+    if (cmd_is(cmd[1], "and"))
+        op = BITOP_AND;
+    else if (cmd_is(cmd[1], "or"))
+        op = BITOP_OR;
+    else if (cmd_is(cmd[1], "xor"))
+        op = BITOP_XOR;
+    else
+        return out_err("expected and, or or xor", out);
+    std::vector<const std::string *> srcs;
+    size_t maxlen = 0;
+    for (size_t i = 3; i < cmd.size(); ++i)
+    {
+        Entry *ent = NULL;
+        uint32_t code = RES_OK;
+        if (!lookup_bits(conn, cmd[i], &ent, &code, out))
+            return code; // Sources loaded so far stay in memory for the retry
+        srcs.push_back(ent ? &ent->str : NULL);
+        maxlen = std::max(maxlen, ent ? ent->str.size() : 0);
+    }
+    std::string res(maxlen, '\0');
+    for (size_t i = 0; i < srcs.size(); ++i)
+    {
+        size_t len = srcs[i] ? srcs[i]->size() : 0;
+        const uint8_t *src = srcs[i] ? (const uint8_t *)srcs[i]->data() : NULL;
+        uint8_t *dst = (uint8_t *)&res[0];
+        if (i == 0)
+        {
+            if (len)
+                memcpy(dst, src, len);
+            continue;
+        }
+        if (len)
+            bits_op(op, dst, src, len);
+        if (op == BITOP_AND && len < maxlen)
+            memset(dst + len, 0, maxlen - len); // ANDed with the zero padding
+    }
+
+    auto it = g_map.find(cmd[2]);
+    if (maxlen == 0)
+    {
+        if (it != g_map.end())
+        {
+            vlog_untrack(it->second); // An empty result deletes the destination
+            g_map.erase(it);
+            tracking_invalidate(cmd[2]);
+        }
+        return out_int(0, out);
+    }
+    Entry &ent = g_map[cmd[2]];
+    vlog_untrack(ent);
+    ent.type = T_STR;
+    ent.str = std::move(res);
+    ent.hash.reset();
+    vlog_track(ent);
+    tracking_invalidate(cmd[2]);
+    return out_int((int64_t)maxlen, out);
+}
+
+// Handles 'tracking on|off', which turns invalidation pushes on or off
+uint32_t do_tracking(
+    Conn *conn, const std::vector<std::string> &cmd, std::string &out)
+{
+    if (cmd_is(cmd[1], "on"))
+        tracking_enable(conn, true);
+    else if (cmd_is(cmd[1], "off"))
+        tracking_enable(conn, false);
+    else
+        return out_err("expected on or off", out);
+    return RES_OK;
+}
+
+// Handles 'subscribe ch...' and 'psubscribe pattern...', responding with the
+// number of channels and patterns the connection is now subscribed to
+uint32_t do_subscribe(
+    Conn *conn, const std::vector<std::string> &cmd, std::string &out)
+{
+    bool pattern = cmd_is(cmd[0], "psubscribe");
+    for (size_t i = 1; i < cmd.size(); ++i)
+    {
+        pubsub_subscribe(conn, cmd[i], pattern);
+    }
+    return out_int((int64_t)(conn->channels.size() + conn->patterns.size()), out);
+}
+
+// Handles 'unsubscribe [ch...]' and 'punsubscribe [pattern...]', which drop
+// every channel or pattern when none is given. Responds with the number of
+// subscriptions left
+uint32_t do_unsubscribe(
+    Conn *conn, const std::vector<std::string> &cmd, std::string &out)
+{
+    bool pattern = cmd_is(cmd[0], "punsubscribe");
+    if (cmd.size() == 1)
+        pubsub_unsubscribe_all(conn, pattern);
+    for (size_t i = 1; i < cmd.size(); ++i)
+    {
+        pubsub_unsubscribe(conn, cmd[i], pattern);
+    }
+    return out_int((int64_t)(conn->channels.size() + conn->patterns.size()), out);
+}
+
+// Handles 'publish ch message', responding with the number of deliveries
+uint32_t do_publish(
+    const std::vector<std::string> &cmd, std::string &out)
+{
+    size_t n = 0;
+    if (!pubsub_publish(cmd[1], cmd[2], &n))
+        return out_err("message too big for a subscriber", out);
+    return out_int((int64_t)n, out);
+}
+
+// Handles 'slowlog get [count]', 'slowlog len' and 'slowlog reset'
+uint32_t do_slowlog(
+    const std::vector<std::string> &cmd, std::string &out)
+{
+    if (cmd.size() <= 3 && cmd_is(cmd[1], "get"))
+    {
+        int64_t count = 10; // Newest entries to return by default
+        if (cmd.size() == 3 && (!str2int(cmd[2], &count) || count < 0))
+            return out_err("not an integer", out);
+        slowlog_format((size_t)count, k_max_msg, &out); // One entry per line
+        return RES_OK;
+    }
+    if (cmd.size() == 2 && cmd_is(cmd[1], "len"))
+        return out_int((int64_t)slowlog_len(), out);
+    if (cmd.size() == 2 && cmd_is(cmd[1], "reset"))
+    {
+        slowlog_reset();
+        return RES_OK;
+    }
+    return out_err("expected get, len or reset", out);
 }
 
 // Checks if a command matches a specified word
@@ -150,39 +792,187 @@ bool cmd_is(const std::string &word, const char *cmd)
 
 // Processes a client request and generates a response
 int32_t do_request(
-    const uint8_t *req, uint32_t reqlen,
-    uint32_t *rescode, uint8_t *res, uint32_t *reslen)
+    Conn *conn, const uint8_t *req, uint32_t reqlen,
+    uint32_t *rescode, std::string &out)
 {
+    bool timed = trace_enabled(); // Timestamp the phases for the slowlog and tracing
+    if (timed)
+    {
+        conn->cur.t_start = get_monotonic_nsec();
+    }
     std::vector<std::string> cmd; // Vector to hold the parsed command
     if (0 != parse_req(req, reqlen, cmd))
     {
         msg("bad req"); // Print message if request parsing fails
         return -1;      // Return error code
     }
+    if (timed)
+    {
+        conn->cur.t_parsed = get_monotonic_nsec();
+    }
     if (cmd.size() == 2 && cmd_is(cmd[0], "get"))
     {
-        *rescode = do_get(cmd, res, reslen); // Handle 'get' command
+        *rescode = do_get(conn, cmd, out); // Handle 'get' command
     }
     else if (cmd.size() == 3 && cmd_is(cmd[0], "set"))
     {
-        *rescode = do_set(cmd, res, reslen); // Handle 'set' command
+        *rescode = do_set(cmd, out); // Handle 'set' command
     }
     else if (cmd.size() == 2 && cmd_is(cmd[0], "del"))
     {
-        *rescode = do_del(cmd, res, reslen); // Handle 'del' command
+        *rescode = do_del(cmd, out); // Handle 'del' command
+    }
+    else if (cmd.size() == 4 && cmd_is(cmd[0], "hset"))
+    {
+        *rescode = do_hset(cmd, out); // Handle 'hset' command
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "hget"))
+    {
+        *rescode = do_hget(conn, cmd, out); // Handle 'hget' command
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "hdel"))
+    {
+        *rescode = do_hdel(cmd, out); // Handle 'hdel' command
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "hgetall"))
+    {
+        *rescode = do_hgetall(conn, cmd, out); // Handle 'hgetall' command
+    }
+    else if (cmd.size() == 4 && cmd_is(cmd[0], "hincrby"))
+    {
+        *rescode = do_hincrby(cmd, out); // Handle 'hincrby' command
+    }
+    else if (cmd.size() == 4 && cmd_is(cmd[0], "setbit"))
+    {
+        *rescode = do_setbit(conn, cmd, out); // Handle 'setbit' command
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "getbit"))
+    {
+        *rescode = do_getbit(conn, cmd, out); // Handle 'getbit' command
+    }
+    else if ((cmd.size() == 2 || cmd.size() == 4) && cmd_is(cmd[0], "bitcount"))
+    {
+        *rescode = do_bitcount(conn, cmd, out); // Handle 'bitcount' command
+    }
+    else if (cmd.size() >= 3 && cmd.size() <= 5 && cmd_is(cmd[0], "bitpos"))
+    {
+        *rescode = do_bitpos(conn, cmd, out); // Handle 'bitpos' command
+    }
+    else if (cmd.size() >= 4 && cmd_is(cmd[0], "bitop"))
+    {
+        *rescode = do_bitop(conn, cmd, out); // Handle 'bitop' command
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "tracking"))
+    {
+        *rescode = do_tracking(conn, cmd, out); // Handle 'tracking' command
+    }
+    else if (cmd.size() >= 2 && (cmd_is(cmd[0], "subscribe") || cmd_is(cmd[0], "psubscribe")))
+    {
+        *rescode = do_subscribe(conn, cmd, out); // Handle 'subscribe' and 'psubscribe' commands
+    }
+    else if (!cmd.empty() && (cmd_is(cmd[0], "unsubscribe") || cmd_is(cmd[0], "punsubscribe")))
+    {
+        *rescode = do_unsubscribe(conn, cmd, out); // Handle 'unsubscribe' and 'punsubscribe' commands
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "publish"))
+    {
+        *rescode = do_publish(cmd, out); // Handle 'publish' command
+    }
+    else if (cmd.size() >= 2 && cmd_is(cmd[0], "slowlog"))
+    {
+        *rescode = do_slowlog(cmd, out); // Handle 'slowlog' command
     }
     else
     {
-        *rescode = RES_ERR; // Set error code for unrecognized command
-        const char *msg = "Unknown cmd";
-        strcpy((char *)res, msg); // Copy error message to response buffer
-        *reslen = strlen(msg);    // Set response length
-        return 0;                 // Return success
+        *rescode = out_err("Unknown cmd", out); // Set error code for unrecognized command
+    }
+    if (timed && *rescode != RES_RETRY) // A retried request is logged when it runs again
+    {
+        conn->cur.t_executed = get_monotonic_nsec();
+        trace_exec(conn, cmd); // Keep the request if it was slow
     }
     return 0; // Return success
 }
 
-// Attempts to parse and respond to a single request from the read buffer
+// Appends a response to the write buffer
+void conn_queue_res(Conn *conn, uint32_t rescode, const uint8_t *res, uint32_t reslen)
+{
+    uint32_t total = reslen + 4;                                 // Add length of response code to total response length
+    const uint8_t *hdr_len = (const uint8_t *)&total;            // Total response length, little endian
+    const uint8_t *hdr_code = (const uint8_t *)&rescode;         // Response code, little endian
+    conn->wbuf.insert(conn->wbuf.end(), hdr_len, hdr_len + 4);   // Append the length header
+    conn->wbuf.insert(conn->wbuf.end(), hdr_code, hdr_code + 4); // Append the response code
+    conn->wbuf.insert(conn->wbuf.end(), res, res + reslen);      // Append the response body
+    conn->wbuf_queued += 8 + reslen;                             // Count the bytes for request tracing
+}
+
+// Builds a complete out-of-band push frame. The body uses the request
+// encoding: the number of strings, then each length-prefixed string
+std::string make_push_frame(const std::vector<std::string> &items)
+{
+    size_t size = 12; // Length, response code and number of strings
+    for (const std::string &s : items)
+    {
+        size += 4 + s.size();
+    }
+    std::string frame;
+    frame.reserve(size); // Built with a single allocation
+    uint32_t total = (uint32_t)(size - 4);
+    uint32_t code = RES_PUSH;
+    uint32_t n = (uint32_t)items.size();
+    frame.append((const char *)&total, 4); // Length of the rest of the frame
+    frame.append((const char *)&code, 4);  // Response code
+    frame.append((const char *)&n, 4);     // Number of strings
+    for (const std::string &s : items)
+    {
+        uint32_t len = (uint32_t)s.size();
+        frame.append((const char *)&len, 4); // Length of the string
+        frame.append(s);
+    }
+    return frame;
+}
+
+// Appends an out-of-band push frame to the write buffer. While a reply is
+// waiting on the value log the push is held back, so that an invalidation
+// can't overtake the value read before the key changed
+void conn_queue_push(Conn *conn, const std::vector<std::string> &items)
+{
+    std::string frame = make_push_frame(items);
+    if (conn->state == STATE_IO)
+    {
+        conn->held_pushes.append(frame); // Queued by conn_resume()
+        return;
+    }
+    conn->wbuf.insert(conn->wbuf.end(), frame.begin(), frame.end());
+    conn->wbuf_queued += frame.size(); // Count the bytes for request tracing
+}
+
+// Called once the value log is done with a connection: queues the pushes
+// held back meanwhile and resumes serving its requests
+void conn_resume(Conn *conn)
+{
+    conn->state = STATE_REQ;
+    if (!conn->held_pushes.empty())
+    {
+        conn->wbuf.insert(conn->wbuf.end(), conn->held_pushes.begin(), conn->held_pushes.end());
+        conn->wbuf_queued += conn->held_pushes.size();
+        std::string().swap(conn->held_pushes);
+    }
+}
+
+// Queues a frame shared with other connections without copying it. It goes
+// out after everything already in the write buffer
+void conn_queue_shared(Conn *conn, const std::shared_ptr<const std::string> &frame)
+{
+    SharedOut so;
+    so.at = conn->wbuf.size();
+    so.buf = frame; // Only the reference count changes
+    conn->wshared.push_back(std::move(so));
+    conn->wshared_bytes += frame->size();
+    conn->wbuf_queued += frame->size();
+}
+
+// Attempts to parse a single request from the read buffer and queue its response
 bool try_one_request(Conn *conn)
 {
     if (conn->rbuf_size < 4)
@@ -199,41 +989,70 @@ bool try_one_request(Conn *conn)
         return false; // Return false if not enough data for the entire request
 
     uint32_t rescode = 0; // Variable to store the response code
-    uint32_t wlen = 0;    // Variable to store the length of the response
+    std::string res;      // Response body
     int32_t err = do_request(
-        &conn->rbuf[4], len,
-        &rescode, &conn->wbuf[4 + 4], &wlen); // Process the request and generate a response
+        conn, &conn->rbuf[4], len,
+        &rescode, res); // Process the request and generate a response
     if (err)
     {
         conn->state = STATE_END; // Set connection state to end if an error occurs
         return false;            // Return false
     }
-    wlen += 4;                           // Add length of response code to total response length
-    memcpy(&conn->wbuf[0], &wlen, 4);    // Copy total response length to write buffer
-    memcpy(&conn->wbuf[4], &rescode, 4); // Copy response code to write buffer
-    conn->wbuf_size = 4 + wlen;          // Set the size of the data in the write buffer
+    if (rescode == RES_RETRY)
+    {
+        conn->cur.keep = false; // Traced when it runs again
+        return false;           // Leave the request buffered until the value is loaded
+    }
+    if (!conn->pinned.empty())
+    {
+        vlog_unpin(conn); // The request is done with the values it loaded
+    }
+    if (rescode != RES_DEFER)
+    {
+        conn_queue_res(conn, rescode, (const uint8_t *)res.data(), (uint32_t)res.size()); // Otherwise the value log queues it later
+        if (conn->cur.keep)
+        {
+            trace_queued(conn); // Follow the slow request until its response is flushed
+        }
+    }
 
     size_t remain = conn->rbuf_size - 4 - len; // Calculate remaining data in read buffer
     if (remain)
     {
-        memmove(conn->rbuf, &conn->rbuf[4 + len], remain); // Move remaining data to the beginning of the buffer
+        memmove(&conn->rbuf[0], &conn->rbuf[4 + len], remain); // Move remaining data to the beginning of the buffer
     }
     conn->rbuf_size = remain; // Update the size of the data in the read buffer
-
-    conn->state = STATE_RES; // Change the connection state to response
-    state_res(conn);         // Handle the response state
-
-    return (conn->state == STATE_REQ); // Return true if the state is back to request
+    if (conn->rbuf.size() > k_rbuf_init && remain <= k_rbuf_init)
+    {
+        conn->rbuf.resize(k_rbuf_init); // Give back the room taken by a large request
+        conn->rbuf.shrink_to_fit();
+    }
+    return true; // A request was consumed
 }
 
 // Attempts to fill the read buffer with data from the connection
 bool try_fill_buffer(Conn *conn)
 {
-    assert(conn->rbuf_size < sizeof(conn->rbuf)); // Ensure the read buffer is not full
-    ssize_t rv = 0;                               // Variable to store the result of read
+    if (conn->rbuf.size() < k_rbuf_init)
+    {
+        conn->rbuf.resize(k_rbuf_init); // Allocate the buffer on first use
+    }
+    if (conn->rbuf_size == conn->rbuf.size())
+    {
+        uint32_t len = 0;
+        memcpy(&len, &conn->rbuf[0], 4); // Read the length of the pending request
+        if (len <= k_max_msg && 4 + len > conn->rbuf.size())
+        {
+            // Grow as the request arrives rather than trusting its header,
+            // so a client can't make the server reserve 16 MB for free
+            conn->rbuf.resize(std::min(conn->rbuf.size() * 2, (size_t)4 + len));
+        }
+    }
+    assert(conn->rbuf_size < conn->rbuf.size()); // Ensure the read buffer is not full
+    ssize_t rv = 0;                              // Variable to store the result of read
     do
     {
-        size_t cap = sizeof(conn->rbuf) - conn->rbuf_size;      // Calculate available space in the buffer
+        size_t cap = conn->rbuf.size() - conn->rbuf_size;       // Calculate available space in the buffer
         rv = read(conn->fd, &conn->rbuf[conn->rbuf_size], cap); // Read data into the buffer
     } while (rv < 0 && errno == EINTR);                         // Retry if interrupted by a signal
     if (rv < 0 && errno == EAGAIN)
@@ -251,24 +1070,88 @@ bool try_fill_buffer(Conn *conn)
         return false;            // Return false
     }
 
-    conn->rbuf_size += (size_t)rv;                 // Add the number of bytes read to the buffer size
-    assert(conn->rbuf_size <= sizeof(conn->rbuf)); // Ensure the buffer is not overfilled
+    if (trace_enabled())
+    {
+        conn->t_read = get_monotonic_nsec(); // When the latest request bytes arrived
+    }
+    conn->rbuf_size += (size_t)rv;                // Add the number of bytes read to the buffer size
+    assert(conn->rbuf_size <= conn->rbuf.size()); // Ensure the buffer is not overfilled
+    return true;                                  // Return true, new data is available
+}
+
+// Returns the number of queued response bytes not yet written to the socket
+size_t conn_pending_out(const Conn *conn)
+{
+    return conn->wbuf.size() - conn->wbuf_sent + conn->wshared_bytes;
+}
+
+// Gathers the unsent output, in order, for a single writev()
+static int out_iov(const Conn *conn, struct iovec *iov)
+{
+    int n = 0;
+    size_t pos = conn->wbuf_sent;        // Next byte of wbuf to gather
+    size_t skip = conn->wshared_sent;    // Already sent part of the first shared frame
+    for (const SharedOut &so : conn->wshared)
+    {
+        if (n + 2 > k_max_iov)
+            return n; // The rest goes out with the next call
+        if (so.at > pos)
+        {
+            iov[n].iov_base = (void *)&conn->wbuf[pos]; // Private bytes queued before the frame
+            iov[n].iov_len = so.at - pos;
+            ++n;
+            pos = so.at;
+        }
+        iov[n].iov_base = (void *)(so.buf->data() + skip);
+        iov[n].iov_len = so.buf->size() - skip;
+        ++n;
+        skip = 0;
+    }
+    if (pos < conn->wbuf.size())
+    {
+        iov[n].iov_base = (void *)&conn->wbuf[pos]; // Private bytes after the last frame
+        iov[n].iov_len = conn->wbuf.size() - pos;
+        ++n;
+    }
+    return n;
+}
 
-    while (try_one_request(conn))
+// Advances the sent counters past 'n' written bytes
+static void out_consume(Conn *conn, size_t n)
+{
+    while (n > 0)
     {
-    }                                  // Process requests one by one
-    return (conn->state == STATE_REQ); // Return true if the state is back to request
+        if (!conn->wshared.empty() && conn->wshared.front().at == conn->wbuf_sent)
+        {
+            const std::string &frame = *conn->wshared.front().buf;
+            size_t take = std::min(n, frame.size() - conn->wshared_sent);
+            conn->wshared_sent += take;
+            conn->wshared_bytes -= take;
+            n -= take;
+            if (conn->wshared_sent == frame.size())
+            {
+                conn->wshared.pop_front(); // Drops this connection's reference
+                conn->wshared_sent = 0;
+            }
+            continue;
+        }
+        size_t end = conn->wshared.empty() ? conn->wbuf.size() : conn->wshared.front().at;
+        size_t take = std::min(n, end - conn->wbuf_sent);
+        conn->wbuf_sent += take;
+        n -= take;
+    }
 }
 
-// Attempts to flush the write buffer to the connection
+// Attempts to flush the write buffer and the shared frames to the connection
 bool try_flush_buffer(Conn *conn)
 {
-    ssize_t rv = 0; // Variable to store the result of write
+    struct iovec iov[k_max_iov];
+    int niov = out_iov(conn, iov); // Gather the output, in order
+    ssize_t rv = 0;                // Variable to store the result of writev
     do
     {
-        size_t remain = conn->wbuf_size - conn->wbuf_sent;          // Calculate remaining data to send
-        rv = write(conn->fd, &conn->wbuf[conn->wbuf_sent], remain); // Write data to the connection
-    } while (rv < 0 && errno == EINTR);                             // Retry if interrupted by a signal
+        rv = writev(conn->fd, iov, niov); // Write data to the connection
+    } while (rv < 0 && errno == EINTR);   // Retry if interrupted by a signal
     if (rv < 0 && errno == EAGAIN)
         return false; // Return false if the operation would block
     if (rv < 0)
@@ -277,32 +1160,116 @@ bool try_flush_buffer(Conn *conn)
         conn->state = STATE_END; // Set connection state to end
         return false;            // Return false
     }
-    conn->wbuf_sent += (size_t)rv;              // Add the number of bytes written to the sent counter
-    assert(conn->wbuf_sent <= conn->wbuf_size); // Ensure the sent counter does not exceed buffer size
-    if (conn->wbuf_sent == conn->wbuf_size)
-    {                            // If all data has been sent
-        conn->state = STATE_REQ; // Change the state back to request
-        conn->wbuf_sent = 0;     // Reset the sent counter
-        conn->wbuf_size = 0;     // Reset the buffer size
-        return false;            // Return false to stop flushing
+    out_consume(conn, (size_t)rv);    // Advance past the bytes written
+    conn->wbuf_flushed += (size_t)rv; // Add them to the running total as well
+    if (!conn->traces.empty())
+    {
+        trace_flushed(conn); // Finish the slow requests whose responses are out
+    }
+    assert(conn->wbuf_sent <= conn->wbuf.size()); // Ensure the sent counter does not exceed buffer size
+    if (conn->wbuf_sent == conn->wbuf.size() && conn->wshared.empty())
+    {                        // If all data has been sent
+        conn->wbuf_sent = 0; // Reset the sent counter
+        conn->wbuf.clear();  // Reset the buffer, keeping its capacity for reuse
+        if (conn->wbuf.capacity() > g_opts.obuf_pause)
+        {
+            std::vector<uint8_t>().swap(conn->wbuf); // Release memory left over from a burst
+        }
+        return false; // Return false to stop flushing
     }
     return true; // Return true to continue flushing
 }
 
+// Returns true if the read buffer already holds a complete request, which
+// happens when a connection used up its budget in the previous loop iteration
+bool conn_has_pending_req(const Conn *conn)
+{
+    if (conn->state != STATE_REQ || conn->rbuf_size < 4)
+        return false;
+    uint32_t len = 0;
+    memcpy(&len, &conn->rbuf[0], 4); // Read the length of the request
+    return len > k_max_msg || 4 + len <= conn->rbuf_size; // Oversized requests are handled (rejected) right away
+}
+
+// Disconnects a client whose queued output exceeds the hard limit, or that has
+// stayed above the soft limit for longer than the configured grace period
+void conn_check_obuf(Conn *conn, uint64_t now_ms)
+{
+    if (conn->state == STATE_END)
+        return;
+    size_t pending = conn_pending_out(conn);
+    if (g_opts.obuf_hard_limit && pending > g_opts.obuf_hard_limit)
+    {
+        msg("output buffer hard limit reached"); // The client isn't reading its replies
+        conn->state = STATE_END;
+        return;
+    }
+    if (!g_opts.obuf_soft_limit || pending <= g_opts.obuf_soft_limit)
+    {
+        conn->obuf_soft_since = 0; // Back under the soft limit, reset the timer
+        return;
+    }
+    if (!conn->obuf_soft_since)
+    {
+        conn->obuf_soft_since = now_ms; // Start timing the soft limit overrun
+    }
+    else if (now_ms - conn->obuf_soft_since >= g_opts.obuf_soft_secs * 1000)
+    {
+        msg("output buffer soft limit reached"); // Over the soft limit for too long
+        conn->state = STATE_END;
+    }
+}
+
 // Handles the response state for a connection
 void state_res(Conn *conn)
 {
+    if (!conn->traces.empty())
+    {
+        conn->t_flush = get_monotonic_nsec(); // Start of the flush phase
+    }
     while (try_flush_buffer(conn))
     {
-    } // Keep flushing the buffer until complete
+    } // Keep flushing the buffer until complete or the socket is full
+    if (conn->wbuf_sent > 0 && conn->wbuf_sent >= conn->wbuf.size() - conn->wbuf_sent)
+    {
+        conn->wbuf.erase(conn->wbuf.begin(), conn->wbuf.begin() + conn->wbuf_sent); // Drop the sent prefix
+        for (SharedOut &so : conn->wshared)
+        {
+            so.at -= conn->wbuf_sent; // Shared frames keep their place in the output
+        }
+        conn->wbuf_sent = 0;
+    }
+    if (conn->state == STATE_RES && conn_pending_out(conn) < g_opts.obuf_pause)
+    {
+        conn->state = STATE_REQ; // The client drained enough output, resume reading
+    }
 }
 
-// Handles the request state for a connection
+// Handles the request state for a connection. At most one budget of requests
+// is served per call so that a pipelining client cannot starve the others
 void state_req(Conn *conn)
 {
-    while (try_fill_buffer(conn))
+    uint32_t nreqs = 0; // Requests served in this call
+    size_t nbytes = 0;  // Request bytes consumed in this call
+    while (conn->state == STATE_REQ)
     {
-    } // Keep filling the buffer and processing requests
+        if (nreqs >= g_opts.max_reqs_per_io || nbytes >= g_opts.max_bytes_per_io)
+            break; // Budget used up, the rest waits for the next loop iteration
+        size_t before = conn->rbuf_size;
+        if (try_one_request(conn))
+        {
+            nreqs++;
+            nbytes += before - conn->rbuf_size;
+            if (conn->state == STATE_REQ && g_opts.obuf_pause && // 0 never pauses
+                conn_pending_out(conn) >= g_opts.obuf_pause)
+            {
+                conn->state = STATE_RES; // Stop reading until the client drains its replies
+            }
+            continue;
+        }
+        if (conn->state != STATE_REQ || !try_fill_buffer(conn))
+            break; // Connection closed or no more data for now
+    }
 }
 
 // Processes I/O operations for a connection based on its state
@@ -310,15 +1277,11 @@ void connection_io(Conn *conn)
 {
     if (conn->state == STATE_REQ)
     {
-        state_req(conn); // Handle request state
-    }
-    else if (conn->state == STATE_RES)
-    {
-        state_res(conn); // Handle response state
+        state_req(conn); // Handle request state, queueing responses
     }
-    else
+    if (conn->state != STATE_END && conn_pending_out(conn))
     {
-        assert(0); // Assert failure if in an unexpected state
+        state_res(conn); // Flush all responses queued so far with as few writes as possible
     }
 }
 
@@ -359,7 +1322,7 @@ int32_t write_all(int fd, const char *buf, size_t n)
 // Sends a request message over a socket
 int32_t send_req(int fd, const std::vector<std::string> &cmd)
 {
-    uint32_t len = 4; // Start with 4 bytes for the count of command strings
+    size_t len = 4; // Start with 4 bytes for the count of command strings
     for (const std::string &s : cmd)
     {
         len += 4 + s.size(); // Calculate total length including each string's length
@@ -369,11 +1332,12 @@ int32_t send_req(int fd, const std::vector<std::string> &cmd)
         return -1; // Return error if length exceeds maximum
     }
 
-    char wbuf[4 + k_max_msg];  // Write buffer
-    memcpy(&wbuf[0], &len, 4); // Copy length to buffer (assuming little endian)
-    uint32_t n = cmd.size();   // Get number of command strings
-    memcpy(&wbuf[4], &n, 4);   // Copy command count to buffer
-    size_t cur = 8;            // Current position in buffer
+    std::vector<char> wbuf(4 + len); // Write buffer
+    uint32_t len32 = (uint32_t)len;  // Fits, it's at most k_max_msg
+    memcpy(&wbuf[0], &len32, 4);     // Copy length to buffer (assuming little endian)
+    uint32_t n = cmd.size();         // Get number of command strings
+    memcpy(&wbuf[4], &n, 4);         // Copy command count to buffer
+    size_t cur = 8;                  // Current position in buffer
     for (const std::string &s : cmd)
     {
         uint32_t p = (uint32_t)s.size();            // Get size of string
@@ -381,15 +1345,15 @@ int32_t send_req(int fd, const std::vector<std::string> &cmd)
         memcpy(&wbuf[cur + 4], s.data(), s.size()); // Copy string data to buffer
         cur += 4 + s.size();                        // Advance current position
     }
-    return write_all(fd, wbuf, 4 + len); // Write the entire buffer to the socket
+    return write_all(fd, wbuf.data(), 4 + len); // Write the entire buffer to the socket
 }
 
-// Reads a response message from a socket
-int32_t read_res(int fd)
+// Reads one response or push frame from a socket
+int32_t read_frame(int fd, uint32_t *rescode, std::string *body)
 {
-    char rbuf[4 + k_max_msg + 1];         // Read buffer
-    errno = 0;                            // Clear errno
-    int32_t err = read_full(fd, rbuf, 4); // Read first 4 bytes (length)
+    char hdr[8];                         // Length and response code
+    errno = 0;                           // Clear errno
+    int32_t err = read_full(fd, hdr, 4); // Read first 4 bytes (length)
     if (err)
     {
         if (errno == 0)
@@ -403,28 +1367,160 @@ int32_t read_res(int fd)
         return err; // Return the error
     }
 
-    uint32_t len = 0;      // Length of the message
-    memcpy(&len, rbuf, 4); // Copy length from buffer (assuming little endian)
-    if (len > k_max_msg)
+    uint32_t len = 0;     // Length of the message
+    memcpy(&len, hdr, 4); // Copy length from buffer (assuming little endian)
+    if (len > 4 + k_max_msg)
     {
-        msg("too long"); // Length exceeds maximum
+        msg("too long"); // Length exceeds maximum, a value plus the response code
         return -1;       // Return error
     }
+    if (len < 4)
+    {
+        msg("bad response"); // Invalid response length
+        return -1;           // Return error
+    }
 
-    err = read_full(fd, &rbuf[4], len); // Read the message body
+    err = read_full(fd, &hdr[4], 4); // Read the response code
+    if (!err)
+    {
+        body->resize(len - 4);
+        err = read_full(fd, &(*body)[0], len - 4); // Read the message body
+    }
     if (err)
     {
         msg("read() error"); // Read error
         return err;          // Return the error
     }
+    memcpy(rescode, &hdr[4], 4); // Copy response code from buffer
+    return 0;                    // Success
+}
 
-    uint32_t rescode = 0; // Response code
-    if (len < 4)
+// Prints strings sent in the request encoding, space-separated
+static void print_strings(const char *prefix, const std::string &body)
+{
+    printf("%s", prefix);
+    uint32_t n = 0;
+    size_t pos = 4;
+    if (body.size() >= 4)
+        memcpy(&n, body.data(), 4); // Number of strings
+    while (n-- && pos + 4 <= body.size())
     {
-        msg("bad response"); // Invalid response length
-        return -1;           // Return error
+        uint32_t len = 0;
+        memcpy(&len, &body[pos], 4); // Length of the string
+        if (pos + 4 + len > body.size())
+            break; // Truncated body, print what is there
+        printf(" %.*s", (int)len, &body[pos + 4]);
+        pos += 4 + len;
+    }
+    printf("\n");
+}
+
+// Reads a response message from a socket, printing any push frames before it.
+// 'strings' is set for commands whose successful reply is a list of strings
+int32_t read_res(int fd, bool strings)
+{
+    while (true)
+    {
+        uint32_t rescode = 0; // Response code
+        std::string body;     // Response body
+        int32_t err = read_frame(fd, &rescode, &body);
+        if (err)
+        {
+            return err; // Return the error
+        }
+        if (rescode == RES_PUSH)
+        {
+            print_strings("server pushes:", body); // Pushes use the request encoding
+            fflush(stdout); // Show pushes as they arrive, e.g. published messages
+            continue;       // The response is still to come
+        }
+        if (strings && rescode == RES_OK)
+        {
+            print_strings("server says: [0]", body);
+            return 0;
+        }
+        printf("server says: [%u] %.*s\n", rescode, (int)body.size(), body.data()); // Print the response
+        return 0;                                                                   // Success
+    }
+}
+
+// Applies an invalidation push to a near cache
+static void cache_apply_push(NearCache *nc, const std::string &body)
+{
+    std::vector<std::string> items;
+    if (0 != parse_req((const uint8_t *)body.data(), body.size(), items))
+        return; // Ignore malformed pushes
+    if (items.size() == 2 && items[0] == "invalidate")
+    {
+        nc->vals.erase(items[1]);
+    }
+}
+
+// Applies the push frames that already arrived, without blocking
+static int32_t cache_drain(NearCache *nc)
+{
+    char c = 0;
+    while (recv(nc->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 1)
+    {
+        uint32_t rescode = 0;
+        std::string body;
+        if (read_frame(nc->fd, &rescode, &body))
+            return -1;
+        if (rescode != RES_PUSH)
+        {
+            msg("unexpected response");
+            return -1;
+        }
+        cache_apply_push(nc, body);
+    }
+    return 0;
+}
+
+// Turns on tracking for a connection so its reads can be cached locally
+int32_t cache_open(NearCache *nc, int fd)
+{
+    nc->fd = fd;
+    nc->vals.clear();
+    if (send_req(fd, {"tracking", "on"}))
+        return -1;
+    uint32_t rescode = 0;
+    std::string body;
+    if (read_frame(fd, &rescode, &body) || rescode != RES_OK)
+        return -1;
+    return 0;
+}
+
+// Gets a value through the near cache. Hits are answered locally once the
+// invalidations already sent by the server have been applied
+int32_t cache_get(NearCache *nc, const std::string &key, uint32_t *rescode, std::string *val)
+{
+    if (cache_drain(nc))
+        return -1;
+    auto it = nc->vals.find(key);
+    if (it != nc->vals.end())
+    {
+        *rescode = RES_OK;
+        *val = it->second;
+        return 0;
+    }
+
+    if (send_req(nc->fd, {"get", key}))
+        return -1;
+    while (true)
+    {
+        if (read_frame(nc->fd, rescode, val))
+            return -1;
+        if (*rescode != RES_PUSH)
+            break;
+        cache_apply_push(nc, *val); // Pushes may arrive ahead of the response
+    }
+    if (*rescode == RES_OK)
+    {
+        if (nc->max_keys && nc->vals.size() >= nc->max_keys)
+        {
+            nc->vals.erase(nc->vals.begin()); // Make room by dropping some entry
+        }
+        nc->vals[key] = *val;
     }
-    memcpy(&rescode, &rbuf[4], 4);                                  // Copy response code from buffer
-    printf("server says: [%u] %.*s\n", rescode, len - 4, &rbuf[8]); // Print the response
-    return 0;                                                       // Success
+    return 0;
 }
@@ -14,9 +14,15 @@
 #include <arpa/inet.h>  // For network byte order conversions
 #include <sys/socket.h> // For socket API functions
 #include <netinet/ip.h> // For IP protocol definitions
+#include <netinet/tcp.h> // For TCP_NODELAY
+#include <sys/un.h>     // For Unix domain socket addresses
+#include <sys/uio.h>    // For writev
+#include <sys/stat.h>   // For lstat
 #include <string>       // For std::string class
 #include <vector>       // For std::vector container
+#include <algorithm>    // For std::min and std::max
 #include <map>          // For std::map container
+#include <ctime>        // For clock_gettime
 
 #include "types.h"
 
@@ -29,6 +35,16 @@ void die(const char *msg);
 
 void fd_set_nb(int fd);
 
+uint64_t get_monotonic_msec();
+
+uint64_t get_monotonic_nsec();
+
+int32_t parse_addr(const char *spec, struct sockaddr_storage *addr, socklen_t *addrlen);
+
+int listen_on(const char *spec);
+
+int connect_to(const char *spec);
+
 void conn_put(std::vector<Conn *> &fd2conn, struct Conn *conn);
 
 int32_t accept_new_conn(std::vector<Conn *> &fd2conn, int fd);
@@ -43,28 +59,108 @@ int32_t parse_req(
     std::vector<std::string> &out);
 
 uint32_t do_get(
+    Conn *conn,
     const std::vector<std::string> &cmd,
-    uint8_t *res,
-    uint32_t *reslen);
+    std::string &out);
 
 uint32_t do_set(
     const std::vector<std::string> &cmd,
-    uint8_t *res,
-    uint32_t *reslen);
+    std::string &out);
 
 uint32_t do_del(
     const std::vector<std::string> &cmd,
-    uint8_t *res,
-    uint32_t *reslen);
+    std::string &out);
+
+uint32_t do_hset(
+    const std::vector<std::string> &cmd,
+    std::string &out);
+
+uint32_t do_hget(
+    Conn *conn,
+    const std::vector<std::string> &cmd,
+    std::string &out);
+
+uint32_t do_hdel(
+    const std::vector<std::string> &cmd,
+    std::string &out);
+
+uint32_t do_hgetall(
+    Conn *conn,
+    const std::vector<std::string> &cmd,
+    std::string &out);
+
+uint32_t do_hincrby(
+    const std::vector<std::string> &cmd,
+    std::string &out);
+
+uint32_t do_setbit(
+    Conn *conn,
+    const std::vector<std::string> &cmd,
+    std::string &out);
+
+uint32_t do_getbit(
+    Conn *conn,
+    const std::vector<std::string> &cmd,
+    std::string &out);
+
+uint32_t do_bitcount(
+    Conn *conn,
+    const std::vector<std::string> &cmd,
+    std::string &out);
+
+uint32_t do_bitpos(
+    Conn *conn,
+    const std::vector<std::string> &cmd,
+    std::string &out);
+
+uint32_t do_bitop(
+    Conn *conn,
+    const std::vector<std::string> &cmd,
+    std::string &out);
+
+uint32_t do_tracking(
+    Conn *conn,
+    const std::vector<std::string> &cmd,
+    std::string &out);
+
+uint32_t do_subscribe(
+    Conn *conn,
+    const std::vector<std::string> &cmd,
+    std::string &out);
+
+uint32_t do_unsubscribe(
+    Conn *conn,
+    const std::vector<std::string> &cmd,
+    std::string &out);
+
+uint32_t do_publish(
+    const std::vector<std::string> &cmd,
+    std::string &out);
+
+uint32_t do_slowlog(
+    const std::vector<std::string> &cmd,
+    std::string &out);
 
 bool cmd_is(const std::string &word, const char *cmd);
 
 int32_t do_request(
+    Conn *conn,
     const uint8_t *req,
     uint32_t reqlen,
     uint32_t *rescode,
-    uint8_t *res,
-    uint32_t *reslen);
+    std::string &out);
+
+void conn_destroy(std::vector<Conn *> &fd2conn, Conn *conn);
+
+void conn_queue_res(Conn *conn, uint32_t rescode, const uint8_t *res, uint32_t reslen);
+
+std::string make_push_frame(const std::vector<std::string> &items);
+
+void conn_queue_push(Conn *conn, const std::vector<std::string> &items);
+
+void conn_resume(Conn *conn);
+
+void conn_queue_shared(Conn *conn, const std::shared_ptr<const std::string> &frame);
 
 bool try_one_request(Conn *conn);
 
@@ -72,6 +168,12 @@ bool try_fill_buffer(Conn *conn);
 
 bool try_flush_buffer(Conn *conn);
 
+size_t conn_pending_out(const Conn *conn);
+
+bool conn_has_pending_req(const Conn *conn);
+
+void conn_check_obuf(Conn *conn, uint64_t now_ms);
+
 void connection_io(Conn *conn);
 
 int32_t read_full(int fd, char *buf, size_t n);
@@ -80,6 +182,12 @@ int32_t write_all(int fd, const char *buf, size_t n);
 
 int32_t send_req(int fd, const std::vector<std::string> &cmd);
 
-int32_t read_res(int fd);
+int32_t read_frame(int fd, uint32_t *rescode, std::string *body);
+
+int32_t read_res(int fd, bool strings);
+
+int32_t cache_open(NearCache *nc, int fd);
+
+int32_t cache_get(NearCache *nc, const std::string &key, uint32_t *rescode, std::string *val);
 
 #endif // FII_DB_UTILITY_H
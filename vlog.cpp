@@ -0,0 +1,680 @@
+//
+// Tiered storage: cold string values are spilled to an append-only,
+// memory-mapped value log on disk and read back through a helper thread
+//
+#include <algorithm>          // For std::min and std::max
+#include <condition_variable> // For std::condition_variable
+#include <deque>              // For std::deque container
+#include <memory>             // For std::shared_ptr
+#include <mutex>              // For std::mutex
+#include <thread>             // For std::thread
+#include <sys/eventfd.h>      // For eventfd, used to wake up the event loop
+#include <sys/mman.h>         // For mmap and mincore
+
+#include "vlog.h"
+#include "utility.h"
+#include "slowlog.h"
+
+// Structure representing one value log segment file
+struct VlogSeg
+{
+    uint32_t id = 0;        // Segment number, also part of the file name
+    int fd = -1;            // File descriptor of the segment file
+    uint8_t *base = NULL;   // Read-only mapping of the whole segment
+    std::string path;       // Path of the segment file
+    size_t used = 0;        // Bytes known to be written to the file
+    size_t vals = 0;        // Value bytes ever written to this segment
+    size_t live = 0;        // Value bytes still referenced by the keyspace
+
+    ~VlogSeg()
+    {
+        if (base)
+            munmap(base, k_vlog_seg_size);
+        if (fd >= 0)
+            close(fd);
+    }
+};
+
+// Enumeration for the kinds of jobs run by the helper thread
+enum VLOG_JOBS
+{
+    JOB_READ = 0, // Read one spilled value for a waiting connection
+    JOB_SCAN = 1, // Read a chunk of a segment being compacted
+    JOB_LOAD = 2, // Bring a value back into memory, then rerun the waiting request
+    JOB_WRITE = 3, // Write appended records to the active segment
+};
+
+// Structure representing a record appended to the log whose write hasn't
+// completed yet. The keyspace only points at it once the write succeeds
+struct VlogRec
+{
+    std::string key;       // Key of the record
+    uint32_t seg = 0;      // Segment the record goes to
+    uint32_t off = 0;      // Offset of the value within that segment
+    uint32_t len = 0;      // Length of the value
+    bool move = false;     // Compaction moving a spilled value, rather than a spill
+    uint32_t from_seg = 0; // For a move: where the value is until the write completes
+    uint32_t from_off = 0;
+};
+
+// Structure representing a read handed to the helper thread
+struct VlogJob
+{
+    uint32_t kind = JOB_READ;     // Kind of job (using the enum above)
+    std::shared_ptr<VlogSeg> seg; // Keeps the mapping alive while the job runs
+    size_t off = 0;               // Offset of the first byte to read
+    size_t len = 0;               // Number of bytes to read
+    int fd = -1;                  // Connection waiting for a JOB_READ or JOB_LOAD
+    uint64_t conn_id = 0;         // Id of that connection, in case the fd is reused
+    std::string key;              // Key being read by a JOB_READ or JOB_LOAD
+    std::string data;             // Bytes read by the helper thread, or to be written by a JOB_WRITE
+    std::vector<VlogRec> recs;    // Records written by a JOB_WRITE
+    int err = 0;                  // errno of a failed JOB_WRITE
+};
+
+// Global state of the value log
+static struct
+{
+    bool enabled = false;                                // True once vlog_init has run
+    std::string dir;                                     // Directory holding the segment files
+    int efd = -1;                                        // Eventfd signalled when jobs complete
+    std::map<uint32_t, std::shared_ptr<VlogSeg>> segs;   // All segments, keyed by id
+    std::shared_ptr<VlogSeg> active;                     // Segment new records are appended to
+    uint32_t next_id = 0;                                // Id of the next segment to create
+    size_t tail = 0;                                     // Offset of the next record in the active segment
+    std::string wpending;                                // Records appended but not yet handed to a write
+    std::vector<VlogRec> wrecs;                          // Those records
+    bool write_inflight = false;                         // A JOB_WRITE is queued or running
+    uint64_t write_retry_ms = 0;                         // No new records before this time, after a failed write
+    uint64_t write_backoff_ms = 0;                       // Delay after the next failed write
+    size_t mem_bytes = 0;                                // String value bytes held in memory
+    size_t spilling_bytes = 0;                           // Of which, bytes waiting for their write
+    uint64_t pin_gen = 0;                                // Last pin_gen handed to an entry
+    std::string clock_key;                               // Where the eviction sweep resumes
+    std::shared_ptr<VlogSeg> compacting;                 // Segment being compacted, if any
+    size_t compact_pos = 0;                              // Next offset to scan in that segment
+    size_t compact_need = 0;                             // Size of a record that didn't fit the last chunk
+    bool scan_inflight = false;                          // A JOB_SCAN is queued or running
+
+    std::mutex mu;                                       // Protects the two queues below
+    std::condition_variable cv;                          // Signalled when a job is queued
+    std::deque<VlogJob *> jobs;                          // Jobs waiting for the helper thread
+    std::deque<VlogJob *> done;                          // Jobs waiting for the event loop
+} g_vlog;
+
+// Runs jobs on the helper thread. Touching the mapping may page-fault and
+// block here, which is exactly what the event loop must never do
+static void vlog_worker()
+{
+    while (true)
+    {
+        VlogJob *job = NULL;
+        {
+            std::unique_lock<std::mutex> lock(g_vlog.mu);
+            g_vlog.cv.wait(lock, [] { return !g_vlog.jobs.empty(); });
+            job = g_vlog.jobs.front();
+            g_vlog.jobs.pop_front();
+        }
+        if (job->kind == JOB_WRITE)
+        {
+            size_t done = 0;
+            while (done < job->data.size())
+            {
+                ssize_t rv = pwrite(job->seg->fd, job->data.data() + done,
+                                    job->data.size() - done, job->off + done);
+                if (rv < 0 && errno == EINTR)
+                    continue; // Retry if interrupted by a signal
+                if (rv <= 0)
+                {
+                    job->err = rv < 0 ? errno : EIO; // E.g. ENOSPC, handled by the event loop
+                    break;
+                }
+                done += (size_t)rv;
+            }
+        }
+        else
+        {
+            job->data.assign((const char *)job->seg->base + job->off, job->len); // Fault the pages in
+        }
+        {
+            std::lock_guard<std::mutex> lock(g_vlog.mu);
+            g_vlog.done.push_back(job);
+        }
+        uint64_t one = 1;
+        (void)write(g_vlog.efd, &one, sizeof(one)); // Wake up the event loop
+    }
+}
+
+// Queues a job for the helper thread
+static void vlog_submit(VlogJob *job)
+{
+    {
+        std::lock_guard<std::mutex> lock(g_vlog.mu);
+        g_vlog.jobs.push_back(job);
+    }
+    g_vlog.cv.notify_one();
+}
+
+// Creates a new segment file and makes it the active one. Returns false,
+// keeping the current one, if the file can't be created
+static bool vlog_new_segment()
+{
+    auto seg = std::make_shared<VlogSeg>();
+    seg->id = g_vlog.next_id;
+    seg->path = g_vlog.dir + "/vlog." + std::to_string(seg->id);
+    seg->fd = open(seg->path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (seg->fd < 0)
+    {
+        msg("vlog open");
+        return false;
+    }
+    // Map the whole segment up front; only the written part is ever touched
+    void *base = mmap(NULL, k_vlog_seg_size, PROT_READ, MAP_SHARED, seg->fd, 0);
+    if (base == MAP_FAILED)
+    {
+        msg("vlog mmap");
+        (void)unlink(seg->path.c_str());
+        return false;
+    }
+    seg->base = (uint8_t *)base;
+    g_vlog.next_id++;
+    g_vlog.segs[seg->id] = seg;
+    g_vlog.active = seg;
+    g_vlog.tail = 0;
+    return true;
+}
+
+// Appends a [u32 klen][u32 vlen][key][value] record to the pending writes
+// and fills in 'rec' with its location. Returns false if it has to wait:
+// the active segment is full and still has writes in flight, or the last
+// write failed not long ago
+static bool vlog_append(const std::string &key, const char *val, size_t vlen, VlogRec &rec)
+{
+    if (g_vlog.write_retry_ms && get_monotonic_msec() < g_vlog.write_retry_ms)
+        return false;
+    size_t size = 8 + key.size() + vlen;
+    if (g_vlog.tail + size > k_vlog_seg_size)
+    {
+        if (g_vlog.write_inflight || !g_vlog.wpending.empty())
+            return false; // Records of one write always go to one segment
+        if (!vlog_new_segment())
+            return false;
+    }
+    uint32_t hdr[2] = {(uint32_t)key.size(), (uint32_t)vlen};
+    g_vlog.wpending.append((const char *)hdr, sizeof(hdr));
+    g_vlog.wpending.append(key);
+    g_vlog.wpending.append(val, vlen);
+    g_vlog.active->vals += vlen;
+    g_vlog.active->live += vlen;
+
+    rec.key = key;
+    rec.seg = g_vlog.active->id;
+    rec.off = (uint32_t)(g_vlog.tail + 8 + key.size());
+    rec.len = (uint32_t)vlen;
+    g_vlog.tail += size;
+    g_vlog.wrecs.push_back(rec);
+    return true;
+}
+
+// Hands the pending records to the helper thread, one write at a time
+static void vlog_write_submit()
+{
+    if (g_vlog.write_inflight || g_vlog.wpending.empty())
+        return;
+    VlogJob *job = new VlogJob();
+    job->kind = JOB_WRITE;
+    job->seg = g_vlog.active;
+    job->off = g_vlog.tail - g_vlog.wpending.size();
+    job->data.swap(g_vlog.wpending);
+    job->recs.swap(g_vlog.wrecs);
+    g_vlog.write_inflight = true;
+    vlog_submit(job);
+}
+
+// Drops the spill of a value that changed while its record was being written
+static void vlog_cancel_spill(Entry &ent)
+{
+    g_vlog.segs[ent.vseg]->live -= ent.vlen; // The record is dead once written
+    g_vlog.spilling_bytes -= ent.vlen;
+    ent.spilling = false;
+}
+
+// Marks the record of a spilled value as dead
+static void vlog_release(Entry &ent)
+{
+    auto it = g_vlog.segs.find(ent.vseg);
+    assert(it != g_vlog.segs.end());
+    it->second->live -= ent.vlen;
+    ent.spilled = false;
+}
+
+// Brings a spilled value back into memory
+static void vlog_promote(Entry &ent, const char *val, size_t len)
+{
+    vlog_release(ent);
+    ent.str.assign(val, len);
+    ent.hot = true;
+    g_vlog.mem_bytes += len;
+}
+
+// Opens the value log in 'dir' and starts the helper thread
+void vlog_init(const std::string &dir)
+{
+    g_vlog.dir = dir;
+    g_vlog.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (g_vlog.efd < 0)
+        die("eventfd");
+    if (!vlog_new_segment())
+        die("vlog segment");
+    std::thread(vlog_worker).detach(); // Lives as long as the server
+    g_vlog.enabled = true;
+}
+
+// Returns true if tiered storage is on
+bool vlog_enabled()
+{
+    return g_vlog.enabled;
+}
+
+// Returns the fd the event loop polls for finished reads, or -1
+int vlog_event_fd()
+{
+    return g_vlog.efd;
+}
+
+// Accounts for a string value just stored in memory
+void vlog_track(Entry &ent)
+{
+    ent.hot = true;
+    g_vlog.mem_bytes += ent.str.size();
+}
+
+// Accounts for a string value about to be replaced or removed
+void vlog_untrack(Entry &ent)
+{
+    if (ent.type != T_STR)
+        return;
+    if (ent.spilled)
+    {
+        vlog_release(ent); // Leaves dead space for compaction to reclaim
+        return;
+    }
+    if (ent.spilling)
+        vlog_cancel_spill(ent); // The value in memory stays authoritative
+    g_vlog.mem_bytes -= ent.str.size();
+}
+
+// Returns true if every page of [p, p + len) is in the page cache, so
+// copying it out cannot stall on disk
+static bool vlog_resident(const uint8_t *p, size_t len)
+{
+    static const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)p & ~(page - 1);
+    uintptr_t end = (uintptr_t)p + len;
+    size_t npages = (end - start + page - 1) / page;
+    unsigned char vec[64];
+    if (npages > sizeof(vec))
+        return false; // Large values always take the helper thread
+    if (mincore((void *)start, end - start, vec))
+        return false;
+    for (size_t i = 0; i < npages; ++i)
+    {
+        if (!(vec[i] & 1))
+            return false;
+    }
+    return true;
+}
+
+// Queues a read of a spilled value and parks the connection until it's done
+static void vlog_read_async(uint32_t kind, Conn *conn, const std::string &key, Entry &ent)
+{
+    VlogJob *job = new VlogJob();
+    job->kind = kind;
+    job->seg = g_vlog.segs[ent.vseg];
+    job->off = ent.voff;
+    job->len = ent.vlen;
+    job->fd = conn->fd;
+    job->conn_id = conn->id;
+    job->key = key;
+    vlog_submit(job);
+    conn->state = STATE_IO; // Stop serving this connection until the value arrives
+}
+
+// Serves 'get' for a spilled value: copied right away if its pages are
+// resident, otherwise read by the helper thread while the connection waits
+uint32_t vlog_get(
+    Conn *conn, const std::string &key, Entry &ent, std::string &out)
+{
+    const uint8_t *val = g_vlog.segs[ent.vseg]->base + ent.voff;
+    if (vlog_resident(val, ent.vlen))
+    {
+        out.assign((const char *)val, ent.vlen);
+        vlog_promote(ent, (const char *)val, ent.vlen);
+        return RES_OK;
+    }
+    vlog_read_async(JOB_READ, conn, key, ent);
+    return RES_DEFER;
+}
+
+// Keeps a value in memory until the connection's current request finishes
+static void vlog_pin(Conn *conn, const std::string &key, Entry &ent)
+{
+    if (!ent.pin_gen)
+        ent.pin_gen = ++g_vlog.pin_gen;
+    ent.pins++;
+    conn->pinned.emplace_back(key, ent.pin_gen);
+}
+
+// Makes sure a string value is in memory, for commands that modify or scan
+// it. Returns false if it must be read from disk first; the connection then
+// waits and its request runs again once the value is back. Values loaded
+// for a request are pinned until it finishes, so a request that needs
+// several of them can't have one evicted while it waits for the next
+bool vlog_load(Conn *conn, const std::string &key, Entry &ent)
+{
+    if (!g_vlog.enabled)
+        return true;
+    if (ent.spilled)
+    {
+        const uint8_t *val = g_vlog.segs[ent.vseg]->base + ent.voff;
+        if (!vlog_resident(val, ent.vlen))
+        {
+            vlog_read_async(JOB_LOAD, conn, key, ent);
+            return false;
+        }
+        vlog_promote(ent, (const char *)val, ent.vlen);
+    }
+    for (const auto &pin : conn->pinned)
+    {
+        if (pin.first == key && pin.second == ent.pin_gen)
+            return true; // Already pinned by an earlier run of the request
+    }
+    vlog_pin(conn, key, ent);
+    return true;
+}
+
+// Releases the values pinned for a connection's request. A key deleted
+// and set again while the request waited is a different entry, whose pins
+// belong to other requests
+void vlog_unpin(Conn *conn)
+{
+    for (const auto &pin : conn->pinned)
+    {
+        auto it = g_map.find(pin.first);
+        if (it != g_map.end() && it->second.pin_gen == pin.second && it->second.pins > 0)
+            it->second.pins--;
+    }
+    conn->pinned.clear();
+}
+
+// Moves cold values to the value log until memory is back under budget.
+// Uses the CLOCK algorithm: a hot entry gets a second chance, a cold one
+// is spilled. A value stays in memory until its write has completed, and a
+// sweep stops once k_vlog_write_batch bytes are waiting to be written, so
+// the event loop only ever copies a bounded amount. Returns true if more
+// work is left for the next iteration
+static bool vlog_evict()
+{
+    if (g_vlog.mem_bytes - g_vlog.spilling_bytes <= g_opts.vlog_max_mem || g_map.empty())
+        return false;
+    bool spilled = false;
+    bool blocked = false;
+    auto it = g_map.lower_bound(g_vlog.clock_key);
+    for (size_t n = 0; n < k_vlog_sweep && g_vlog.mem_bytes - g_vlog.spilling_bytes > g_opts.vlog_max_mem; ++n, ++it)
+    {
+        if (g_vlog.wpending.size() >= k_vlog_write_batch)
+        {
+            blocked = true; // Wait for the write in flight to finish
+            break;
+        }
+        if (it == g_map.end())
+            it = g_map.begin(); // Wrap around
+        Entry &ent = it->second;
+        if (ent.type != T_STR || ent.spilled || ent.spilling || ent.pins || ent.str.size() < k_vlog_min_value)
+            continue; // Not spillable, already on its way out, or needed by a waiting request
+        if (ent.hot)
+        {
+            ent.hot = false; // Second chance
+            continue;
+        }
+        VlogRec rec;
+        if (!vlog_append(it->first, ent.str.data(), ent.str.size(), rec))
+        {
+            blocked = true;
+            break;
+        }
+        ent.spilling = true; // Spilled for good once the write succeeds
+        ent.vseg = rec.seg;
+        ent.voff = rec.off;
+        ent.vlen = rec.len;
+        g_vlog.spilling_bytes += rec.len;
+        spilled = true;
+    }
+    g_vlog.clock_key = (it == g_map.end()) ? std::string() : it->first;
+    return spilled && !blocked && g_vlog.mem_bytes - g_vlog.spilling_bytes > g_opts.vlog_max_mem;
+}
+
+// Settles the records of a finished write: spilled values leave memory and
+// moved values point at their new place. If the write failed, the records
+// are dropped along with those appended after them, and values stay where
+// they were
+static void vlog_write_done(VlogJob *job)
+{
+    g_vlog.write_inflight = false;
+    VlogSeg *seg = job->seg.get();
+    if (job->err)
+    {
+        fprintf(stderr, "vlog write: %s\n", strerror(job->err));
+        std::vector<VlogRec> failed = std::move(job->recs);
+        failed.insert(failed.end(), g_vlog.wrecs.begin(), g_vlog.wrecs.end());
+        g_vlog.wrecs.clear();
+        g_vlog.wpending.clear();
+        for (const VlogRec &rec : failed)
+        {
+            seg->vals -= rec.len;
+            auto it = g_map.find(rec.key);
+            bool match = it != g_map.end() && it->second.spilling &&
+                         it->second.vseg == rec.seg && it->second.voff == rec.off;
+            if (rec.move || match)
+                seg->live -= rec.len; // Cancelled spills already gave their bytes back
+            if (match)
+            {
+                it->second.spilling = false; // Stays in memory
+                g_vlog.spilling_bytes -= rec.len;
+            }
+        }
+        g_vlog.tail = seg->used; // The next write starts where the failed one did
+        g_vlog.compacting.reset(); // Its moves failed; the segment is scanned again later
+        // Back off before trying again, a full disk won't clear up right away
+        g_vlog.write_backoff_ms = std::min<uint64_t>(
+            std::max<uint64_t>(g_vlog.write_backoff_ms * 2, 1000), 60 * 1000);
+        g_vlog.write_retry_ms = get_monotonic_msec() + g_vlog.write_backoff_ms;
+        return;
+    }
+    g_vlog.write_backoff_ms = 0;
+    g_vlog.write_retry_ms = 0;
+    seg->used = job->off + job->data.size();
+    for (const VlogRec &rec : job->recs)
+    {
+        auto it = g_map.find(rec.key);
+        Entry *ent = (it == g_map.end()) ? NULL : &it->second;
+        if (!rec.move && ent && ent->spilling && ent->vseg == rec.seg && ent->voff == rec.off)
+        {
+            ent->spilling = false; // Readers use the log from now on
+            ent->spilled = true;
+            g_vlog.spilling_bytes -= rec.len;
+            g_vlog.mem_bytes -= rec.len;
+            std::string().swap(ent->str); // Keep only the key and the offset in memory
+        }
+        else if (rec.move && ent && ent->spilled && ent->vseg == rec.from_seg && ent->voff == rec.from_off)
+        {
+            vlog_release(*ent); // The old copy is dead now
+            ent->spilled = true;
+            ent->vseg = rec.seg;
+            ent->voff = rec.off;
+        }
+        else if (rec.move)
+        {
+            seg->live -= rec.len; // The value changed while it was being moved
+        }
+    }
+}
+
+// Starts or continues compacting a segment that is mostly dead space
+static void vlog_compact_step()
+{
+    if (g_vlog.scan_inflight || g_vlog.write_retry_ms)
+        return;
+    if (!g_vlog.compacting)
+    {
+        for (auto &kv : g_vlog.segs)
+        {
+            VlogSeg *seg = kv.second.get();
+            if (seg != g_vlog.active.get() && seg->live * 2 < seg->vals)
+            {
+                g_vlog.compacting = kv.second;
+                g_vlog.compact_pos = 0;
+                g_vlog.compact_need = 0;
+                break;
+            }
+        }
+        VlogSeg *act = g_vlog.active.get();
+        if (!g_vlog.compacting && act->vals >= k_vlog_roll_min && act->live * 2 < act->vals &&
+            !g_vlog.write_inflight && g_vlog.wpending.empty())
+        {
+            // Mostly dead and every record written: start a new segment so
+            // that this one can be compacted, even in a store under 1 GiB
+            (void)vlog_new_segment();
+        }
+        if (!g_vlog.compacting)
+            return; // Nothing worth compacting
+    }
+
+    VlogSeg *seg = g_vlog.compacting.get();
+    if (seg->live == 0)
+    {
+        (void)unlink(seg->path.c_str()); // Freed once the last reader drops it
+        g_vlog.segs.erase(seg->id);
+        g_vlog.compacting.reset();
+        return;
+    }
+    if (g_vlog.compact_pos >= seg->used)
+    {
+        if (!g_vlog.write_inflight && g_vlog.wpending.empty())
+        {
+            seg->vals = seg->live; // Nothing left to move, don't pick it again for now
+            g_vlog.compacting.reset();
+        }
+        return; // Otherwise wait for the moves to be written
+    }
+
+    VlogJob *job = new VlogJob();
+    job->kind = JOB_SCAN;
+    job->seg = g_vlog.compacting;
+    job->off = g_vlog.compact_pos;
+    job->len = std::max(k_vlog_scan_chunk, g_vlog.compact_need); // Room for at least one whole record
+    job->len = std::min(job->len, seg->used - g_vlog.compact_pos);
+    g_vlog.scan_inflight = true;
+    vlog_submit(job);
+}
+
+// Re-appends the live records of a scanned chunk, leaving only dead ones behind
+static void vlog_compact_chunk(VlogJob *job)
+{
+    g_vlog.scan_inflight = false;
+    if (job->seg != g_vlog.compacting)
+        return;
+    const std::string &data = job->data;
+    size_t pos = 0;
+    while (pos + 8 <= data.size())
+    {
+        uint32_t hdr[2] = {0, 0};
+        memcpy(hdr, &data[pos], sizeof(hdr));
+        size_t rec = 8 + hdr[0] + hdr[1];
+        if (pos + rec > data.size())
+        {
+            g_vlog.compact_need = rec; // Partial record, the next chunk starts here
+            break;
+        }
+        std::string key(&data[pos + 8], hdr[0]);
+        size_t voff = job->off + pos + 8 + hdr[0];
+        auto it = g_map.find(key);
+        if (it != g_map.end() && it->second.spilled &&
+            it->second.vseg == job->seg->id && it->second.voff == voff)
+        {
+            VlogRec move;
+            move.move = true;
+            move.from_seg = job->seg->id;
+            move.from_off = (uint32_t)voff;
+            if (!vlog_append(key, &data[pos + 8 + hdr[0]], hdr[1], move))
+                break; // Still live, but the log can't take it now; rescanned from here
+        }
+        pos += rec;
+    }
+    g_vlog.compact_pos = job->off + pos;
+}
+
+// Delivers a value read by the helper thread to the waiting connection
+static void vlog_read_done(VlogJob *job, std::vector<Conn *> &fd2conn)
+{
+    Conn *conn = ((size_t)job->fd < fd2conn.size()) ? fd2conn[job->fd] : NULL;
+    if (conn && (conn->id != job->conn_id || conn->state != STATE_IO))
+        conn = NULL; // The connection went away while the read was running
+    auto it = g_map.find(job->key);
+    if (it != g_map.end() && it->second.spilled &&
+        it->second.vseg == job->seg->id && it->second.voff == job->off)
+    {
+        vlog_promote(it->second, job->data.data(), job->data.size()); // Just read, so it's hot
+        if (conn && job->kind == JOB_LOAD)
+            vlog_pin(conn, job->key, it->second); // Stays in memory until the request has run
+    }
+    if (!conn)
+        return;
+    if (job->kind == JOB_LOAD)
+    {
+        conn_resume(conn); // The request is still buffered and runs again
+        return;
+    }
+    conn_queue_res(conn, RES_OK, (const uint8_t *)job->data.data(), (uint32_t)job->data.size());
+    if (conn->cur.keep)
+    {
+        trace_queued(conn); // The read counts as queueing time
+    }
+    conn_resume(conn); // Resume serving its pipelined requests, after any held pushes
+}
+
+// Runs the value log's share of an event loop iteration: eviction, finished
+// reads and compaction. Returns true if it wants to run again right away
+bool vlog_cron(std::vector<Conn *> &fd2conn)
+{
+    if (!g_vlog.enabled)
+        return false;
+
+    // Evict before delivering reads, so that a value just loaded for a
+    // waiting request is still in memory when the request runs again
+    if (g_vlog.write_retry_ms && get_monotonic_msec() >= g_vlog.write_retry_ms)
+        g_vlog.write_retry_ms = 0; // Done backing off after a failed write
+    bool more = vlog_evict();
+
+    uint64_t cnt = 0;
+    (void)read(g_vlog.efd, &cnt, sizeof(cnt)); // Reset the wakeup counter
+    std::deque<VlogJob *> done;
+    {
+        std::lock_guard<std::mutex> lock(g_vlog.mu);
+        done.swap(g_vlog.done);
+    }
+    for (VlogJob *job : done)
+    {
+        if (job->kind == JOB_SCAN)
+            vlog_compact_chunk(job);
+        else if (job->kind == JOB_WRITE)
+            vlog_write_done(job);
+        else
+            vlog_read_done(job, fd2conn);
+        delete job;
+    }
+
+    vlog_compact_step();
+    vlog_write_submit(); // Readers only see records once their write completed
+    return more;
+}
@@ -0,0 +1,54 @@
+//
+// Tiered storage: cold string values are spilled to an append-only,
+// memory-mapped value log on disk and read back through a helper thread
+//
+#include <cstdint> // For fixed-width integer types
+#include <string>  // For std::string class
+#include <vector>  // For std::vector container
+
+#include "types.h"
+
+#ifndef FII_DB_VLOG_H
+#define FII_DB_VLOG_H
+
+// Size of each value log segment file; offsets within a segment fit 32 bits
+const size_t k_vlog_seg_size = (size_t)1 << 30;
+
+// Values shorter than this stay in memory, spilling them would save nothing
+const size_t k_vlog_min_value = 64;
+
+// Number of keys the eviction sweep looks at per event loop iteration
+const size_t k_vlog_sweep = 1024;
+
+// Number of bytes read per compaction step
+const size_t k_vlog_scan_chunk = 1024 * 1024;
+
+// Number of bytes an eviction sweep may leave waiting for the helper thread to write
+const size_t k_vlog_write_batch = 8 * 1024 * 1024;
+
+// Number of value bytes the active segment holds before it may be rolled to compact it
+const size_t k_vlog_roll_min = 16 * 1024 * 1024;
+
+void vlog_init(const std::string &dir);
+
+bool vlog_enabled();
+
+int vlog_event_fd();
+
+void vlog_track(Entry &ent);
+
+void vlog_untrack(Entry &ent);
+
+uint32_t vlog_get(
+    Conn *conn,
+    const std::string &key,
+    Entry &ent,
+    std::string &out);
+
+bool vlog_load(Conn *conn, const std::string &key, Entry &ent);
+
+void vlog_unpin(Conn *conn);
+
+bool vlog_cron(std::vector<Conn *> &fd2conn);
+
+#endif // FII_DB_VLOG_H